@@ -2,26 +2,90 @@
 #include "stdlib.h"
 #include "string.h"
 #include "stdint.h"
+#include <inttypes.h>
 #include <stdbool.h>
 #include "inputBuffer/inputBuffer.h"
 #include <fcntl.h>
 #include <unistd.h>
+#include <pthread.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
 
 #define TABLE_MAX_PAGE 100
+#define SCAN_MAX_WORKERS 8
+#define LOOKUP_CACHE_SIZE 4096
+#define LOOKUP_CACHE_PROBES 8
+#define LAZY_DELETE_BATCH 64
+#define CELL_FLAG_DELETED 1
+#define CHECK_MAX_LEVELS 16
+#define CHECK_FILL_BUCKETS 4
+#define MAX_SHARDS 16
+#define SHARD_SPLIT_PAGES 64
+#define ROW_BUFFER_INITIAL_ROWS 64
+#define FILE_MAGIC 0x5242444D
+#define COMPRESSED_MAGIC 0x5A42444D
+#define FILE_FORMAT_VERSION 1
+#define JOURNAL_MAGIC 0x4A42444D
+#define LZ_HASH_BITS 12
+#define LZ_MIN_MATCH 4
+#define LZ_LAST_LITERALS 5
 #define INVALID_PAGE_NUM UINT32_MAX
 
-typedef enum { STATEMENT_INSERT, STATEMENT_SELECT, STATEMENT_SELECT_BY_ID, STATEMENT_DELETE_BY_ID, STATEMENT_UPDATE_BY_ID} StatementType;
+typedef enum { STATEMENT_INSERT, STATEMENT_SELECT, STATEMENT_SELECT_BY_ID, STATEMENT_DELETE_BY_ID, STATEMENT_UPDATE_BY_ID, STATEMENT_AGGREGATE, STATEMENT_BEGIN, STATEMENT_COMMIT, STATEMENT_ROLLBACK} StatementType;
 typedef enum { NODE_LEAF, NODE_INTERNAL} NodeType;
+typedef enum { SHARD_TASK_STATEMENT, SHARD_TASK_COLLECT, SHARD_TASK_AGGREGATE, SHARD_TASK_META, SHARD_TASK_EXIT} ShardTaskType;
+typedef enum { AGGREGATE_COUNT, AGGREGATE_MIN, AGGREGATE_MAX, AGGREGATE_SUM} AggregateType;
+typedef enum { PREDICATE_NONE, PREDICATE_LESS, PREDICATE_GREATER, PREDICATE_EQUAL} PredicateType;
 
+typedef struct {
+  char* path;
+  int file_des;
+  bool incremental;
+  bool running;
+  uint32_t num_pages;
+  uint32_t num_written;
+  bool copied[TABLE_MAX_PAGE];
+  void* before_images[TABLE_MAX_PAGE];
+} Backup;
 typedef struct{
   uint32_t file_length;
   int file_des;
   uint32_t num_pages;
   void* pages[TABLE_MAX_PAGE];
+  uint32_t page_version[TABLE_MAX_PAGE];
+  pthread_mutex_t lock;
+  Backup* backup;
+  pthread_t backup_thread;
+  char* last_backup_path;
+  uint32_t backup_checksums[TABLE_MAX_PAGE];
+  bool backup_checksum_valid[TABLE_MAX_PAGE];
+  bool compressed;
+  uint32_t extent_offset[TABLE_MAX_PAGE];
+  uint32_t extent_length[TABLE_MAX_PAGE];
+  uint32_t extent_capacity[TABLE_MAX_PAGE];
+  bool in_transaction;
+  uint32_t undo_num_pages;
+  void* undo_images[TABLE_MAX_PAGE];
+  char* journal_path;
 } Pager;
+typedef struct {
+  uint32_t key;
+  uint32_t page_num;
+  uint32_t cell_num;
+  uint32_t version;
+  bool used;
+} LookupEntry;
+typedef struct {
+  LookupEntry entries[LOOKUP_CACHE_SIZE];
+} LookupCache;
 typedef struct {
   Pager* pager;
   uint32_t root_page_num;
+  LookupCache* cache;
+  bool lazy_delete;
+  uint32_t num_tombstones;
+  uint32_t undo_num_tombstones;
 } Table;
 typedef struct {
   uint32_t id;
@@ -34,6 +98,8 @@ typedef struct {
   Row row_to_insert;
   bool update_user_name;
   bool update_email;
+  AggregateType aggregate;
+  PredicateType predicate;
 } Statement;
 typedef struct{
   Table* table;
@@ -41,6 +107,85 @@ typedef struct{
   uint32_t cell_num;
   bool end_of_table;
 } Cursor;
+typedef struct {
+  uint64_t count;
+  uint64_t sum;
+  uint32_t min;
+  uint32_t max;
+} AggregateResult;
+typedef struct {
+  Table* table;
+  Statement* statement;
+  uint32_t morsels[TABLE_MAX_PAGE];
+  uint32_t num_morsels;
+  uint32_t next_morsel;
+  AggregateResult results[SCAN_MAX_WORKERS];
+} ScanJob;
+typedef struct {
+  ScanJob* job;
+  uint32_t worker_num;
+} ScanWorker;
+typedef struct {
+  uint32_t num_errors;
+  uint32_t leaf_level;
+  uint32_t num_nodes[CHECK_MAX_LEVELS];
+  uint32_t fill[CHECK_MAX_LEVELS][CHECK_FILL_BUCKETS];
+  uint64_t fill_sum[CHECK_MAX_LEVELS];
+} CheckResult;
+typedef struct {
+  uint32_t page_num;
+  uint32_t parent_page_num;
+  uint32_t low;
+  uint32_t high;
+  bool has_low;
+  bool has_high;
+} CheckMorsel;
+typedef struct {
+  Table* table;
+  CheckMorsel morsels[TABLE_MAX_PAGE];
+  uint32_t num_morsels;
+  uint32_t next_morsel;
+  CheckResult results[SCAN_MAX_WORKERS];
+} CheckJob;
+typedef struct {
+  CheckJob* job;
+  uint32_t worker_num;
+} CheckWorker;
+typedef struct {
+  Row* rows;
+  uint32_t num_rows;
+  uint32_t capacity;
+} RowBuffer;
+typedef struct {
+  ShardTaskType type;
+  Statement* statement;
+  InputBuffer* inp_buf;
+  bool result;
+  AggregateResult aggregate;
+  RowBuffer rows;
+  bool done;
+} ShardTask;
+typedef struct {
+  Table* table;
+  uint32_t low_key;
+  uint32_t file_num;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  ShardTask* task;
+  ShardTask pending;
+  Statement pending_statement;
+  bool has_pending;
+  bool split_failed;
+} Shard;
+typedef struct {
+  const char* filename;
+  bool compressed;
+  bool in_transaction;
+  Shard* shards[MAX_SHARDS];
+  uint32_t num_shards;
+  uint32_t next_file_num;
+} ShardSet;
 
 const uint32_t PAGES_SIZE = 4096;
 const uint32_t ID_SIZE = sizeof(((Row*)0)->id);
@@ -57,7 +202,9 @@ const uint32_t IS_ROOT_SIZE = sizeof(uint8_t);
 const uint32_t IS_ROOT_OFFSET = NODE_TYPE_SIZE+NODE_TYPE_OFFSET;
 const uint32_t PARENT_POINTER_SIZE = sizeof(uint32_t);
 const uint32_t PARENT_POINTER_OFFSET = IS_ROOT_OFFSET+IS_ROOT_SIZE;
-const uint32_t NODE_HEADER_SIZE = NODE_TYPE_SIZE+IS_ROOT_SIZE+PARENT_POINTER_SIZE;
+const uint32_t CHECKSUM_SIZE = sizeof(uint32_t);
+const uint32_t CHECKSUM_OFFSET = PARENT_POINTER_OFFSET+PARENT_POINTER_SIZE;
+const uint32_t NODE_HEADER_SIZE = NODE_TYPE_SIZE+IS_ROOT_SIZE+PARENT_POINTER_SIZE+CHECKSUM_SIZE;
 
 const uint32_t LEAF_NODE_NCELLS_SIZE = sizeof(uint32_t);
 const uint32_t LEAF_NODE_NCELLS_OFFSET = NODE_HEADER_SIZE;
@@ -66,7 +213,9 @@ const uint32_t LEAF_NODE_KEY_SIZE = sizeof(uint32_t);
 const uint32_t LEAF_NODE_KEY_OFFSET = 0;
 const uint32_t LEAF_NODE_VALUE_SIZE = ROW_SIZE;
 const uint32_t LEAF_NODE_VALUE_OFFSET = LEAF_NODE_KEY_SIZE;
-const uint32_t LEAF_NODE_CELL_SIZE = LEAF_NODE_VALUE_SIZE+LEAF_NODE_KEY_SIZE;
+const uint32_t LEAF_NODE_FLAGS_SIZE = sizeof(uint8_t);
+const uint32_t LEAF_NODE_FLAGS_OFFSET = LEAF_NODE_VALUE_OFFSET+LEAF_NODE_VALUE_SIZE;
+const uint32_t LEAF_NODE_CELL_SIZE = LEAF_NODE_VALUE_SIZE+LEAF_NODE_KEY_SIZE+LEAF_NODE_FLAGS_SIZE;
 // const uint32_t LEAF_NODE_MAX_CELLS = (PAGES_SIZE-LEAF_NODE_HEADER_SIZE)/LEAF_NODE_CELL_SIZE;
 const uint32_t LEAF_NODE_MAX_CELLS = 5;
 
@@ -86,6 +235,25 @@ const uint32_t INTERNAL_NODE_MAX_CELLS = 3;
 const uint32_t INTERNAL_NODE_CELLS_LEFT = (INTERNAL_NODE_MAX_CELLS+1)/2;
 const uint32_t INTERNAL_NODE_CELLS_RIGHT = INTERNAL_NODE_MAX_CELLS-INTERNAL_NODE_CELLS_LEFT;
 
+const uint32_t FILE_MAGIC_OFFSET = 0;
+const uint32_t FILE_VERSION_OFFSET = sizeof(uint32_t);
+const uint32_t FILE_NUM_PAGES_OFFSET = 2*sizeof(uint32_t);
+const uint32_t FILE_EXTENTS_OFFSET = 3*sizeof(uint32_t);
+const uint32_t FILE_EXTENT_SIZE = 3*sizeof(uint32_t);
+const uint32_t FILE_HEADER_SIZE = 4096;
+
+const uint32_t JOURNAL_MAGIC_OFFSET = 0;
+const uint32_t JOURNAL_FILE_LENGTH_OFFSET = sizeof(uint32_t);
+const uint32_t JOURNAL_NUM_RECORDS_OFFSET = 2*sizeof(uint32_t);
+const uint32_t JOURNAL_HEADER_SIZE = 3*sizeof(uint32_t);
+const uint32_t JOURNAL_RECORD_OFFSET_OFFSET = 0;
+const uint32_t JOURNAL_RECORD_LENGTH_OFFSET = sizeof(uint32_t);
+const uint32_t JOURNAL_RECORD_CHECKSUM_OFFSET = 2*sizeof(uint32_t);
+const uint32_t JOURNAL_RECORD_HEADER_SIZE = 3*sizeof(uint32_t);
+
+const uint32_t LEGACY_NODE_HEADER_SIZE = NODE_TYPE_SIZE+IS_ROOT_SIZE+PARENT_POINTER_SIZE;
+const uint32_t LEGACY_LEAF_NODE_CELL_SIZE = LEAF_NODE_KEY_SIZE+LEAF_NODE_VALUE_SIZE;
+
 NodeType node_type(void* node){
   return (NodeType)(*(uint8_t*)(node));
 }
@@ -101,6 +269,9 @@ void set_node_root(void* node, bool is_root){
 uint32_t* get_parent(void* page){
   return page + PARENT_POINTER_OFFSET;
 }
+uint32_t* get_checksum(void* page){
+  return page + CHECKSUM_OFFSET;
+}
 uint32_t* leaf_node_num_cells(void* node){
   return node+LEAF_NODE_NCELLS_OFFSET;
 }
@@ -113,6 +284,15 @@ uint32_t* leaf_node_key(void* node, uint32_t cell_num){
 void* leaf_node_value(void* node, uint32_t cell_num){
   return leaf_node_cell(node, cell_num)+LEAF_NODE_VALUE_OFFSET;
 }
+uint8_t* leaf_node_flags(void* node, uint32_t cell_num){
+  return leaf_node_cell(node, cell_num)+LEAF_NODE_FLAGS_OFFSET;
+}
+bool is_cell_deleted(void* node, uint32_t cell_num){
+  return (*leaf_node_flags(node, cell_num))&CELL_FLAG_DELETED;
+}
+bool is_live_cell(void* node, uint32_t cell_num, uint32_t key){
+  return (*leaf_node_num_cells(node)>cell_num)&&(*leaf_node_key(node, cell_num)==key)&&(!is_cell_deleted(node, cell_num));
+}
 uint32_t* internal_node_num_key(void* node){
   return node+INTERNAL_NODE_NUM_KEYS_OFFSET;
 }
@@ -147,6 +327,311 @@ void initialize_internal_node(void* node){
   *internal_node_right_child(node)=INVALID_PAGE_NUM;
 }
 
+uint32_t crc32c_table[256];
+bool crc32c_hardware = false;
+pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+void crc32c_init(){
+  for (uint32_t i=0; i<256; i++){
+    uint32_t crc = i;
+    for (int j=0; j<8; j++){
+      crc = (crc>>1)^(0x82F63B78&(-(crc&1)));
+    }
+    crc32c_table[i] = crc;
+  }
+#if defined(__x86_64__)
+  crc32c_hardware = __builtin_cpu_supports("sse4.2");
+#endif
+}
+uint32_t crc32c_software(uint32_t crc, const uint8_t* data, size_t length){
+  for (size_t i=0; i<length; i++){
+    crc = crc32c_table[(crc^data[i])&0xFF]^(crc>>8);
+  }
+  return crc;
+}
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+uint32_t crc32c_sse42(uint32_t crc, const uint8_t* data, size_t length){
+  uint64_t crc64 = crc;
+  uint64_t word;
+  for (; length>=8; length-=8, data+=8){
+    memcpy(&word, data, sizeof(word));
+    crc64 = _mm_crc32_u64(crc64, word);
+  }
+  crc = (uint32_t)crc64;
+  for (; length>0; length--, data++){
+    crc = _mm_crc32_u8(crc, *data);
+  }
+  return crc;
+}
+#endif
+uint32_t crc32c(uint32_t crc, const void* data, size_t length){
+#if defined(__x86_64__)
+  if (crc32c_hardware){
+    return crc32c_sse42(crc, data, length);
+  }
+#endif
+  return crc32c_software(crc, data, length);
+}
+uint32_t page_checksum(void* page){
+  uint32_t crc = crc32c(UINT32_MAX, page, CHECKSUM_OFFSET);
+  crc = crc32c(crc, page+CHECKSUM_OFFSET+CHECKSUM_SIZE, PAGES_SIZE-CHECKSUM_OFFSET-CHECKSUM_SIZE);
+  return ~crc;
+}
+uint32_t lz_read32(const uint8_t* data){
+  uint32_t value;
+  memcpy(&value, data, sizeof(value));
+  return value;
+}
+bool lz_write_length(uint8_t* dst, uint32_t capacity, uint32_t* op, uint32_t length){
+  for (; length>=255; length-=255){
+    if (*op>=capacity){
+      return false;
+    }
+    dst[(*op)++] = 255;
+  }
+  if (*op>=capacity){
+    return false;
+  }
+  dst[(*op)++] = length;
+  return true;
+}
+bool lz_emit(uint8_t* dst, uint32_t capacity, uint32_t* op, const uint8_t* literals, uint32_t literal_length, uint32_t offset, uint32_t match_length){
+  if (*op>=capacity){
+    return false;
+  }
+  uint32_t token_pos = (*op)++;
+  uint8_t token = (literal_length>=15?15:literal_length)<<4;
+  if ((literal_length>=15)&&(!lz_write_length(dst, capacity, op, literal_length-15))){
+    return false;
+  }
+  if (*op+literal_length>capacity){
+    return false;
+  }
+  memcpy(dst+*op, literals, literal_length);
+  *op += literal_length;
+  if (match_length>0){
+    if (*op+2>capacity){
+      return false;
+    }
+    dst[(*op)++] = offset&0xFF;
+    dst[(*op)++] = offset>>8;
+    uint32_t extra = match_length-LZ_MIN_MATCH;
+    token |= extra>=15?15:extra;
+    if ((extra>=15)&&(!lz_write_length(dst, capacity, op, extra-15))){
+      return false;
+    }
+  }
+  dst[token_pos] = token;
+  return true;
+}
+uint32_t lz_compress(const uint8_t* src, uint32_t src_length, uint8_t* dst, uint32_t capacity){
+  int32_t table[1<<LZ_HASH_BITS];
+  for (uint32_t i=0; i<(1<<LZ_HASH_BITS); i++){
+    table[i] = -1;
+  }
+  uint32_t ip = 0;
+  uint32_t anchor = 0;
+  uint32_t op = 0;
+  while (ip+LZ_MIN_MATCH+LZ_LAST_LITERALS<=src_length){
+    uint32_t sequence = lz_read32(src+ip);
+    uint32_t hash = (sequence*2654435761u)>>(32-LZ_HASH_BITS);
+    int32_t ref = table[hash];
+    table[hash] = ip;
+    if ((ref<0)||(ip-ref>0xFFFF)||(lz_read32(src+ref)!=sequence)){
+      ip++;
+      continue;
+    }
+    uint32_t match_length = LZ_MIN_MATCH;
+    while ((ip+match_length<src_length-LZ_LAST_LITERALS)&&(src[ref+match_length]==src[ip+match_length])){
+      match_length++;
+    }
+    if (!lz_emit(dst, capacity, &op, src+anchor, ip-anchor, ip-ref, match_length)){
+      return 0;
+    }
+    ip += match_length;
+    anchor = ip;
+  }
+  if (!lz_emit(dst, capacity, &op, src+anchor, src_length-anchor, 0, 0)){
+    return 0;
+  }
+  return op;
+}
+bool lz_read_length(const uint8_t* src, uint32_t src_length, uint32_t* ip, uint32_t* length){
+  uint8_t byte;
+  do {
+    if (*ip>=src_length){
+      return false;
+    }
+    byte = src[(*ip)++];
+    *length += byte;
+  } while (byte==255);
+  return true;
+}
+uint32_t lz_decompress(const uint8_t* src, uint32_t src_length, uint8_t* dst, uint32_t capacity){
+  uint32_t ip = 0;
+  uint32_t op = 0;
+  while (ip<src_length){
+    uint8_t token = src[ip++];
+    uint32_t literal_length = token>>4;
+    if ((literal_length==15)&&(!lz_read_length(src, src_length, &ip, &literal_length))){
+      return 0;
+    }
+    if ((ip+literal_length>src_length)||(op+literal_length>capacity)){
+      return 0;
+    }
+    memcpy(dst+op, src+ip, literal_length);
+    ip += literal_length;
+    op += literal_length;
+    if (ip==src_length){
+      break;
+    }
+    if (ip+2>src_length){
+      return 0;
+    }
+    uint32_t offset = src[ip]|(src[ip+1]<<8);
+    ip += 2;
+    uint32_t match_length = token&15;
+    if ((match_length==15)&&(!lz_read_length(src, src_length, &ip, &match_length))){
+      return 0;
+    }
+    match_length += LZ_MIN_MATCH;
+    if ((offset==0)||(offset>op)||(op+match_length>capacity)){
+      return 0;
+    }
+    for (uint32_t i=0; i<match_length; i++, op++){
+      dst[op] = dst[op-offset];
+    }
+  }
+  return op;
+}
+void pager_read_header(Pager* pager){
+  uint8_t header[FILE_HEADER_SIZE];
+  if (pread(pager->file_des, header, FILE_HEADER_SIZE, 0)!=FILE_HEADER_SIZE){
+    printf("Error read file\n");
+    exit(EXIT_FAILURE);
+  }
+  uint32_t version = lz_read32(header+FILE_VERSION_OFFSET);
+  if (version!=FILE_FORMAT_VERSION){
+    printf("Error unsupported file format version %d\n", version);
+    exit(EXIT_FAILURE);
+  }
+  pager->compressed = lz_read32(header+FILE_MAGIC_OFFSET)==COMPRESSED_MAGIC;
+  pager->num_pages = pager->compressed?lz_read32(header+FILE_NUM_PAGES_OFFSET):(pager->file_length-FILE_HEADER_SIZE)/PAGES_SIZE;
+  if (pager->num_pages>TABLE_MAX_PAGE){
+    printf("Error corrupt file header\n");
+    exit(EXIT_FAILURE);
+  }
+  if (!pager->compressed){
+    return;
+  }
+  for (uint32_t i=0; i<TABLE_MAX_PAGE; i++){
+    uint8_t* extent = header+FILE_EXTENTS_OFFSET+FILE_EXTENT_SIZE*i;
+    pager->extent_offset[i] = lz_read32(extent);
+    pager->extent_length[i] = lz_read32(extent+sizeof(uint32_t));
+    pager->extent_capacity[i] = lz_read32(extent+2*sizeof(uint32_t));
+    if ((pager->extent_length[i]>pager->extent_capacity[i])||(pager->extent_capacity[i]>PAGES_SIZE)||((uint64_t)pager->extent_offset[i]+pager->extent_capacity[i]>pager->file_length)){
+      printf("Error corrupt file header\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+}
+void encode_file_header(uint8_t* header, uint32_t magic, uint32_t num_pages){
+  uint32_t version = FILE_FORMAT_VERSION;
+  memset(header, 0, FILE_HEADER_SIZE);
+  memcpy(header+FILE_MAGIC_OFFSET, &magic, sizeof(uint32_t));
+  memcpy(header+FILE_VERSION_OFFSET, &version, sizeof(uint32_t));
+  memcpy(header+FILE_NUM_PAGES_OFFSET, &num_pages, sizeof(uint32_t));
+}
+void pager_write_header(Pager* pager){
+  uint8_t header[FILE_HEADER_SIZE];
+  encode_file_header(header, pager->compressed?COMPRESSED_MAGIC:FILE_MAGIC, pager->num_pages);
+  for (uint32_t i=0; i<TABLE_MAX_PAGE; i++){
+    uint8_t* extent = header+FILE_EXTENTS_OFFSET+FILE_EXTENT_SIZE*i;
+    memcpy(extent, &(pager->extent_offset[i]), sizeof(uint32_t));
+    memcpy(extent+sizeof(uint32_t), &(pager->extent_length[i]), sizeof(uint32_t));
+    memcpy(extent+2*sizeof(uint32_t), &(pager->extent_capacity[i]), sizeof(uint32_t));
+  }
+  if (pwrite(pager->file_des, header, FILE_HEADER_SIZE, 0)==-1){
+    printf("Error write\n");
+    exit(EXIT_FAILURE);
+  }
+}
+void pager_rewrite_file(Pager* pager, const char* filename, bool compressed);
+void pager_convert_legacy(Pager* pager, const char* filename){
+  if ((pager->file_length%PAGES_SIZE!=0)||(pager->file_length/PAGES_SIZE>TABLE_MAX_PAGE)){
+    printf("Error unrecognized file format\n");
+    exit(EXIT_FAILURE);
+  }
+  pager->num_pages = pager->file_length/PAGES_SIZE;
+  uint8_t legacy[PAGES_SIZE];
+  for (uint32_t i=0; i<pager->num_pages; i++){
+    if (pread(pager->file_des, legacy, PAGES_SIZE, PAGES_SIZE*i)!=PAGES_SIZE){
+      printf("Error read file\n");
+      exit(EXIT_FAILURE);
+    }
+    void* page = calloc(1, PAGES_SIZE);
+    memcpy(page, legacy, LEGACY_NODE_HEADER_SIZE);
+    uint32_t num_cells = lz_read32(legacy+LEGACY_NODE_HEADER_SIZE);
+    if ((node_type(page)==NODE_LEAF)&&(num_cells<=LEAF_NODE_MAX_CELLS)){
+      *leaf_node_num_cells(page) = num_cells;
+      for (uint32_t j=0; j<num_cells; j++){
+        memcpy(leaf_node_cell(page, j), legacy+LEGACY_NODE_HEADER_SIZE+LEAF_NODE_NCELLS_SIZE+LEGACY_LEAF_NODE_CELL_SIZE*j, LEGACY_LEAF_NODE_CELL_SIZE);
+      }
+    } else if ((node_type(page)==NODE_INTERNAL)&&(num_cells<=INTERNAL_NODE_MAX_CELLS)){
+      memcpy(page+INTERNAL_NODE_NUM_KEYS_OFFSET, legacy+LEGACY_NODE_HEADER_SIZE, PAGES_SIZE-INTERNAL_NODE_NUM_KEYS_OFFSET);
+    } else {
+      printf("Error unrecognized file format\n");
+      exit(EXIT_FAILURE);
+    }
+    pager->pages[i] = page;
+  }
+  pager_rewrite_file(pager, filename, false);
+  printf("converted %s to file format version %d\n", filename, FILE_FORMAT_VERSION);
+}
+bool journal_read_record(int journal_fd, uint32_t* journal_offset, uint32_t* offset, uint32_t* length, uint8_t* data){
+  uint8_t record[JOURNAL_RECORD_HEADER_SIZE];
+  if (pread(journal_fd, record, JOURNAL_RECORD_HEADER_SIZE, *journal_offset)!=JOURNAL_RECORD_HEADER_SIZE){
+    return false;
+  }
+  *offset = lz_read32(record+JOURNAL_RECORD_OFFSET_OFFSET);
+  *length = lz_read32(record+JOURNAL_RECORD_LENGTH_OFFSET);
+  if ((*length>PAGES_SIZE)||(pread(journal_fd, data, *length, *journal_offset+JOURNAL_RECORD_HEADER_SIZE)!=*length)){
+    return false;
+  }
+  *journal_offset += JOURNAL_RECORD_HEADER_SIZE+*length;
+  return lz_read32(record+JOURNAL_RECORD_CHECKSUM_OFFSET)==~crc32c(UINT32_MAX, data, *length);
+}
+void pager_replay_journal(int fd, const char* journal_path){
+  int journal_fd = open(journal_path, O_RDONLY);
+  if (journal_fd==-1){
+    return;
+  }
+  uint8_t header[JOURNAL_HEADER_SIZE];
+  uint8_t data[PAGES_SIZE];
+  bool valid = (pread(journal_fd, header, JOURNAL_HEADER_SIZE, 0)==JOURNAL_HEADER_SIZE)&&(lz_read32(header+JOURNAL_MAGIC_OFFSET)==JOURNAL_MAGIC);
+  uint32_t num_records = valid?lz_read32(header+JOURNAL_NUM_RECORDS_OFFSET):0;
+  for (uint32_t pass=0; (valid)&&(pass<2); pass++){
+    uint32_t journal_offset = JOURNAL_HEADER_SIZE;
+    uint32_t offset, length;
+    for (uint32_t i=0; (valid)&&(i<num_records); i++){
+      valid = journal_read_record(journal_fd, &journal_offset, &offset, &length, data);
+      if ((valid)&&(pass==1)&&(pwrite(fd, data, length, offset)!=length)){
+        printf("Error write\n");
+        exit(EXIT_FAILURE);
+      }
+    }
+  }
+  if (valid){
+    if ((ftruncate(fd, lz_read32(header+JOURNAL_FILE_LENGTH_OFFSET))==-1)||(fsync(fd)==-1)){
+      printf("Error write\n");
+      exit(EXIT_FAILURE);
+    }
+    printf("rolled back an interrupted commit from %s\n", journal_path);
+  }
+  close(journal_fd);
+  unlink(journal_path);
+}
 Pager* pager_open(const char* filename){
   int fd = open(filename, O_RDWR|O_CREAT, S_IWUSR|S_IRUSR);
   if (fd==-1){
@@ -154,18 +639,88 @@ Pager* pager_open(const char* filename){
     exit(EXIT_FAILURE);
   }
   Pager* pager  = (Pager*)malloc(sizeof(Pager));
+  pthread_once(&crc32c_once, crc32c_init);
+  pager->journal_path = malloc(strlen(filename)+16);
+  sprintf(pager->journal_path, "%s-journal", filename);
+  pager_replay_journal(fd, pager->journal_path);
   pager->file_length = lseek(fd, 0, SEEK_END);
   pager->file_des = fd;
-  pager->num_pages = pager->file_length/PAGES_SIZE;
+  pager->num_pages = 0;
   for (uint32_t i=0; i<TABLE_MAX_PAGE; i++){
     pager->pages[i]=NULL;
+    pager->page_version[i]=0;
+    pager->backup_checksum_valid[i]=false;
+    pager->undo_images[i]=NULL;
+  }
+  pager->in_transaction = false;
+  pager->backup = NULL;
+  pager->last_backup_path = NULL;
+  pager->compressed = false;
+  pthread_mutex_init(&(pager->lock), NULL);
+  uint32_t magic = 0;
+  if (pager->file_length==0){
+    pager->file_length = FILE_HEADER_SIZE;
+    pager_write_header(pager);
+  } else if ((pager->file_length>=FILE_HEADER_SIZE)&&(pread(fd, &magic, sizeof(magic), 0)==sizeof(magic))&&((magic==FILE_MAGIC)||(magic==COMPRESSED_MAGIC))){
+    pager_read_header(pager);
+  } else {
+    pager_convert_legacy(pager, filename);
   }
   return pager;
 }
 void print_row(Row row){
   printf("| %-*d | %*s | %*s |\n", 5, row.id, 10, row.user_name, 25, row.email);
 }
+bool prepare_aggregate(char* args, Statement* stm){
+  if (strncmp(args, " count(*)", 9)==0){
+    stm->aggregate = AGGREGATE_COUNT;
+    args += 9;
+  } else if (strncmp(args, " min(id)", 8)==0){
+    stm->aggregate = AGGREGATE_MIN;
+    args += 8;
+  } else if (strncmp(args, " max(id)", 8)==0){
+    stm->aggregate = AGGREGATE_MAX;
+    args += 8;
+  } else if (strncmp(args, " sum(id)", 8)==0){
+    stm->aggregate = AGGREGATE_SUM;
+    args += 8;
+  } else {
+    return false;
+  }
+  stm->predicate = PREDICATE_NONE;
+  if (*args==0){
+    return true;
+  }
+  char op;
+  if (sscanf(args, " where id%c%d", &op, &(stm->key))<2){
+    return false;
+  }
+  switch (op) {
+    case '<':
+      stm->predicate = PREDICATE_LESS;
+      return true;
+    case '>':
+      stm->predicate = PREDICATE_GREATER;
+      return true;
+    case '=':
+      stm->predicate = PREDICATE_EQUAL;
+      return true;
+  }
+  return false;
+}
 bool prepare_statement(InputBuffer* inp_buf, Statement* stm){
+  if (strcmp(inp_buf->buffer, "begin")==0){
+    stm->type = STATEMENT_BEGIN;
+    return true;
+  }
+  if (strcmp(inp_buf->buffer, "commit")==0){
+    stm->type = STATEMENT_COMMIT;
+    return true;
+  }
+  if (strcmp(inp_buf->buffer, "rollback")==0){
+    stm->type = STATEMENT_ROLLBACK;
+    return true;
+  }
   if (strncmp(inp_buf->buffer, "insert", 6)==0){
     stm->type = STATEMENT_INSERT;
     if (sscanf(inp_buf->buffer, "insert %d %s %s", &(stm->row_to_insert.id),
@@ -182,6 +737,10 @@ bool prepare_statement(InputBuffer* inp_buf, Statement* stm){
     return false;
   }
   if (strncmp(inp_buf->buffer, "select", 6)==0) {
+    if (prepare_aggregate(inp_buf->buffer+6, stm)){
+      stm->type = STATEMENT_AGGREGATE;
+      return true;
+    }
     if (strcmp(inp_buf->buffer, "select")==0){
       stm->type = STATEMENT_SELECT;
       return true;
@@ -230,8 +789,32 @@ bool prepare_statement(InputBuffer* inp_buf, Statement* stm){
   }
   return false;
 }
+void pager_flush_compressed(Pager* pager, uint32_t page_num){
+  uint8_t buffer[PAGES_SIZE];
+  void* data = buffer;
+  uint32_t length = lz_compress(pager->pages[page_num], PAGES_SIZE, buffer, PAGES_SIZE-1);
+  if (length==0){
+    data = pager->pages[page_num];
+    length = PAGES_SIZE;
+  }
+  if (length>pager->extent_capacity[page_num]){
+    pager->extent_offset[page_num] = pager->file_length;
+    pager->extent_capacity[page_num] = length;
+    pager->file_length += length;
+  }
+  pager->extent_length[page_num] = length;
+  if (pwrite(pager->file_des, data, length, pager->extent_offset[page_num])==-1){
+    printf("Error write\n");
+    exit(EXIT_FAILURE);
+  }
+}
 void pager_flush(Pager* pager, uint32_t page_num){
-  if (lseek(pager->file_des, page_num*PAGES_SIZE, SEEK_SET)==-1){
+  *get_checksum(pager->pages[page_num]) = page_checksum(pager->pages[page_num]);
+  if (pager->compressed){
+    pager_flush_compressed(pager, page_num);
+    return;
+  }
+  if (lseek(pager->file_des, FILE_HEADER_SIZE+page_num*PAGES_SIZE, SEEK_SET)==-1){
     printf("Error\n");
     exit(EXIT_FAILURE);
   }
@@ -241,19 +824,47 @@ void pager_flush(Pager* pager, uint32_t page_num){
   }
 }
 
+void flush_db(Table* table){
+  Pager* pager = table->pager;
+  for (uint32_t i=0; i<pager->num_pages; i++){
+    if (pager->pages[i]!=NULL){
+      pager_flush(pager, i);
+    }
+  }
+  if (pager->compressed){
+    pager_write_header(pager);
+  }
+  if (fsync(pager->file_des)==-1){
+    printf("Error fsync\n");
+    exit(EXIT_FAILURE);
+  }
+}
+void finish_backup(Pager* pager);
+void pager_rollback(Pager* pager);
 void close_db(Table* table){
   Pager* pager = table->pager;
+  finish_backup(pager);
+  if (pager->in_transaction){
+    printf("rolling back open transaction\n");
+    pager_rollback(pager);
+  }
   for (uint32_t i=0; i<table->pager->num_pages; i++){
     if (pager->pages[i]!=NULL){
       pager_flush(pager, i);
       free(pager->pages[i]);
     }
   }
+  if (pager->compressed){
+    pager_write_header(pager);
+  }
   if (close(pager->file_des)==-1){
     printf("Error close\n");
     exit(EXIT_FAILURE);
   }
+  free(pager->last_backup_path);
+  free(pager->journal_path);
   free(pager);
+  free(table->cache);
   free(table);
 }
 void serialize_row(Row* source, void* des){
@@ -266,23 +877,189 @@ void deserialize_row(Row* des, void* source){
   memcpy(&(des->user_name), source + USERNAME_OFFSET, USERNAME_SIZE);
   memcpy(&(des->email), source + EMAIL_OFFSET, EMAIL_SIZE);
 }
+bool pager_load_page(Pager* pager, uint32_t page_num, void* page){
+  if (pager->compressed){
+    uint32_t length = pager->extent_length[page_num];
+    uint8_t buffer[PAGES_SIZE];
+    void* data = length==PAGES_SIZE?page:buffer;
+    if ((length==0)||(length>PAGES_SIZE)||(pread(pager->file_des, data, length, pager->extent_offset[page_num])!=length)){
+      printf("Error read file\n");
+      exit(EXIT_FAILURE);
+    }
+    if ((length<PAGES_SIZE)&&(lz_decompress(buffer, length, page, PAGES_SIZE)!=PAGES_SIZE)){
+      return false;
+    }
+  } else if (pread(pager->file_des, page, PAGES_SIZE, FILE_HEADER_SIZE+PAGES_SIZE*page_num)==-1){
+    printf("Error read file\n");
+    exit(EXIT_FAILURE);
+  }
+  return *get_checksum(page)==page_checksum(page);
+}
+void pager_read_page(Pager* pager, uint32_t page_num, void* page){
+  if (!pager_load_page(pager, page_num, page)){
+    printf("Error checksum page %d\n", page_num);
+    exit(EXIT_FAILURE);
+  }
+}
 void* get_page(Pager* pager, uint32_t page_num){
+  pthread_mutex_lock(&(pager->lock));
   if (pager->pages[page_num]==NULL){
     void* page = malloc(PAGES_SIZE);
     uint32_t num_page = pager->num_pages;
     if (page_num<num_page){
-      lseek(pager->file_des, PAGES_SIZE*page_num, SEEK_SET);
-      if (read(pager->file_des, page, PAGES_SIZE)==-1){
-        printf("Error read file\n");
-        exit(EXIT_FAILURE);
-      }
+      pager_read_page(pager, page_num, page);
     }
     else{
       pager->num_pages = page_num + 1;
     }
     pager->pages[page_num] = page;
   }
-  return pager->pages[page_num];
+  void* page = pager->pages[page_num];
+  Backup* backup = pager->backup;
+  if ((backup!=NULL)&&(backup->running)&&(page_num<backup->num_pages)&&(!backup->copied[page_num])&&(backup->before_images[page_num]==NULL)){
+    backup->before_images[page_num] = malloc(PAGES_SIZE);
+    memcpy(backup->before_images[page_num], page, PAGES_SIZE);
+  }
+  if ((pager->in_transaction)&&(page_num<pager->undo_num_pages)&&(pager->undo_images[page_num]==NULL)){
+    pager->undo_images[page_num] = malloc(PAGES_SIZE);
+    memcpy(pager->undo_images[page_num], page, PAGES_SIZE);
+  }
+  pthread_mutex_unlock(&(pager->lock));
+  return page;
+}
+void* get_page_checked(Pager* pager, uint32_t page_num){
+  pthread_mutex_lock(&(pager->lock));
+  if ((pager->pages[page_num]==NULL)&&(page_num<pager->num_pages)){
+    void* page = malloc(PAGES_SIZE);
+    if (!pager_load_page(pager, page_num, page)){
+      free(page);
+      pthread_mutex_unlock(&(pager->lock));
+      return NULL;
+    }
+    pager->pages[page_num] = page;
+  }
+  pthread_mutex_unlock(&(pager->lock));
+  return get_page(pager, page_num);
+}
+void touch_page(Pager* pager, uint32_t page_num){
+  pager->page_version[page_num] += 1;
+}
+void pager_begin(Pager* pager){
+  pthread_mutex_lock(&(pager->lock));
+  pager->in_transaction = true;
+  pager->undo_num_pages = pager->num_pages;
+  pthread_mutex_unlock(&(pager->lock));
+}
+void journal_write_record(Pager* pager, int journal_fd, uint32_t* journal_offset, uint32_t* num_records, uint32_t offset, uint32_t length, uint32_t file_length){
+  if (offset>=file_length){
+    return;
+  }
+  if (length>file_length-offset){
+    length = file_length-offset;
+  }
+  uint8_t record[JOURNAL_RECORD_HEADER_SIZE+PAGES_SIZE];
+  if (pread(pager->file_des, record+JOURNAL_RECORD_HEADER_SIZE, length, offset)!=length){
+    printf("Error read file\n");
+    exit(EXIT_FAILURE);
+  }
+  uint32_t checksum = ~crc32c(UINT32_MAX, record+JOURNAL_RECORD_HEADER_SIZE, length);
+  memcpy(record+JOURNAL_RECORD_OFFSET_OFFSET, &offset, sizeof(uint32_t));
+  memcpy(record+JOURNAL_RECORD_LENGTH_OFFSET, &length, sizeof(uint32_t));
+  memcpy(record+JOURNAL_RECORD_CHECKSUM_OFFSET, &checksum, sizeof(uint32_t));
+  if (pwrite(journal_fd, record, JOURNAL_RECORD_HEADER_SIZE+length, *journal_offset)==-1){
+    printf("Error write\n");
+    exit(EXIT_FAILURE);
+  }
+  *journal_offset += JOURNAL_RECORD_HEADER_SIZE+length;
+  *num_records += 1;
+}
+void pager_write_journal(Pager* pager, bool* dirty){
+  uint32_t file_length = lseek(pager->file_des, 0, SEEK_END);
+  int journal_fd = open(pager->journal_path, O_RDWR|O_CREAT|O_TRUNC, S_IWUSR|S_IRUSR);
+  if (journal_fd==-1){
+    printf("Error open file\n");
+    exit(EXIT_FAILURE);
+  }
+  uint32_t journal_offset = JOURNAL_HEADER_SIZE;
+  uint32_t num_records = 0;
+  if (pager->compressed){
+    journal_write_record(pager, journal_fd, &journal_offset, &num_records, 0, FILE_HEADER_SIZE, file_length);
+  }
+  for (uint32_t i=0; i<pager->num_pages; i++){
+    if (!dirty[i]){
+      continue;
+    }
+    if (!pager->compressed){
+      journal_write_record(pager, journal_fd, &journal_offset, &num_records, FILE_HEADER_SIZE+i*PAGES_SIZE, PAGES_SIZE, file_length);
+    } else if (pager->extent_capacity[i]>0){
+      journal_write_record(pager, journal_fd, &journal_offset, &num_records, pager->extent_offset[i], pager->extent_capacity[i], file_length);
+    }
+  }
+  uint8_t header[JOURNAL_HEADER_SIZE];
+  uint32_t magic = JOURNAL_MAGIC;
+  memcpy(header+JOURNAL_MAGIC_OFFSET, &magic, sizeof(uint32_t));
+  memcpy(header+JOURNAL_FILE_LENGTH_OFFSET, &file_length, sizeof(uint32_t));
+  memcpy(header+JOURNAL_NUM_RECORDS_OFFSET, &num_records, sizeof(uint32_t));
+  if ((pwrite(journal_fd, header, JOURNAL_HEADER_SIZE, 0)==-1)||(fsync(journal_fd)==-1)){
+    printf("Error write\n");
+    exit(EXIT_FAILURE);
+  }
+  close(journal_fd);
+}
+void pager_commit(Pager* pager){
+  pthread_mutex_lock(&(pager->lock));
+  pager->in_transaction = false;
+  pthread_mutex_unlock(&(pager->lock));
+  bool dirty[TABLE_MAX_PAGE];
+  bool any_dirty = false;
+  for (uint32_t i=0; i<pager->num_pages; i++){
+    dirty[i] = false;
+    if (pager->pages[i]==NULL){
+      continue;
+    }
+    dirty[i] = (i>=pager->undo_num_pages)||(*get_checksum(pager->pages[i])!=page_checksum(pager->pages[i]));
+    if (pager->undo_images[i]!=NULL){
+      dirty[i] = dirty[i]||(memcmp(pager->undo_images[i], pager->pages[i], PAGES_SIZE)!=0);
+      free(pager->undo_images[i]);
+      pager->undo_images[i] = NULL;
+    }
+    any_dirty = any_dirty||dirty[i];
+  }
+  if (!any_dirty){
+    return;
+  }
+  pager_write_journal(pager, dirty);
+  for (uint32_t i=0; i<pager->num_pages; i++){
+    if (dirty[i]){
+      pager_flush(pager, i);
+    }
+  }
+  if (pager->compressed){
+    pager_write_header(pager);
+  }
+  if (fsync(pager->file_des)==-1){
+    printf("Error fsync\n");
+    exit(EXIT_FAILURE);
+  }
+  unlink(pager->journal_path);
+}
+void pager_rollback(Pager* pager){
+  pthread_mutex_lock(&(pager->lock));
+  pager->in_transaction = false;
+  for (uint32_t i=0; i<pager->num_pages; i++){
+    if (i>=pager->undo_num_pages){
+      free(pager->pages[i]);
+      pager->pages[i] = NULL;
+      touch_page(pager, i);
+    } else if (pager->undo_images[i]!=NULL){
+      memcpy(pager->pages[i], pager->undo_images[i], PAGES_SIZE);
+      free(pager->undo_images[i]);
+      pager->undo_images[i] = NULL;
+      touch_page(pager, i);
+    }
+  }
+  pager->num_pages = pager->undo_num_pages;
+  pthread_mutex_unlock(&(pager->lock));
 }
 void advance_cur(Cursor* cur) {
   cur->cell_num +=1;
@@ -290,11 +1067,51 @@ void advance_cur(Cursor* cur) {
     cur->end_of_table = true;
   }
 }
-Table* open_db(const char* filename){
+void pager_rewrite_file(Pager* pager, const char* filename, bool compressed){
+  char* temp_filename = malloc(strlen(filename)+8);
+  sprintf(temp_filename, "%s.tmp", filename);
+  int fd = open(temp_filename, O_RDWR|O_CREAT|O_TRUNC, S_IWUSR|S_IRUSR);
+  if (fd==-1){
+    printf("Error open file\n");
+    exit(EXIT_FAILURE);
+  }
+  close(pager->file_des);
+  pager->file_des = fd;
+  pager->file_length = FILE_HEADER_SIZE;
+  pager->compressed = compressed;
+  for (uint32_t i=0; i<TABLE_MAX_PAGE; i++){
+    pager->extent_offset[i] = 0;
+    pager->extent_length[i] = 0;
+    pager->extent_capacity[i] = 0;
+  }
+  for (uint32_t i=0; i<pager->num_pages; i++){
+    pager_flush(pager, i);
+  }
+  pager_write_header(pager);
+  if ((fsync(fd)==-1)||(rename(temp_filename, filename)==-1)){
+    printf("Error write\n");
+    exit(EXIT_FAILURE);
+  }
+  free(temp_filename);
+}
+void pager_compress_file(Pager* pager, const char* filename){
+  for (uint32_t i=0; i<pager->num_pages; i++){
+    get_page(pager, i);
+  }
+  pager_rewrite_file(pager, filename, true);
+}
+Table* open_db(const char* filename, bool compressed){
   Pager* pager = pager_open(filename);
+  if ((compressed)&&(!pager->compressed)){
+    pager_compress_file(pager, filename);
+  }
   Table* tab = (Table*)malloc(sizeof(Table));
   tab->root_page_num = 0;
   tab->pager = pager;
+  tab->cache = (LookupCache*)calloc(1, sizeof(LookupCache));
+  tab->lazy_delete = false;
+  tab->num_tombstones = 0;
+  tab->undo_num_tombstones = 0;
   if (pager->num_pages==0){
     void* root = get_page(pager, 0);
     initialize_leaf_node(root);
@@ -314,6 +1131,18 @@ uint32_t get_node_max_key(Pager* pager, void* node){
       return *leaf_node_key(node, *leaf_node_num_cells(node)-1);
   }
 }
+void* get_edge_leaf(Pager* pager, void* node, bool rightmost){
+  switch (node_type(node)) {
+    case NODE_INTERNAL:
+      if (rightmost){
+        return get_edge_leaf(pager, get_page(pager, *internal_node_right_child(node)), rightmost);
+      }
+      return get_edge_leaf(pager, get_page(pager, *internal_node_child(node, 0)), rightmost);
+    case NODE_LEAF:
+      return node;
+  }
+  return node;
+}
 void print_pr() {
   printf("miniDB > ");
 }
@@ -344,6 +1173,8 @@ void creat_new_root(Table* table, uint32_t page_num_right){
   void* left = get_page(table->pager, page_num_left);
   memcpy(left, root, PAGES_SIZE);
   set_node_root(left, false);
+  touch_page(table->pager, table->root_page_num);
+  touch_page(table->pager, page_num_left);
   if (node_type(left)==NODE_INTERNAL){
     initialize_internal_node(right);
     void* child;
@@ -452,6 +1283,7 @@ void leaf_node_split_and_insert(Cursor* cur, Row* value, uint32_t key) {
     if (i == cur->cell_num){
       serialize_row(value, leaf_node_value(temp, index_in_node));
       *leaf_node_key(temp, index_in_node) = key;
+      *leaf_node_flags(temp, index_in_node) = 0;
     } else if (i > cur->cell_num){
       memcpy(leaf_node_cell(temp, index_in_node), leaf_node_cell(old_node, i-1), LEAF_NODE_CELL_SIZE);
     } else{
@@ -460,6 +1292,8 @@ void leaf_node_split_and_insert(Cursor* cur, Row* value, uint32_t key) {
   }
   *leaf_node_num_cells(old_node)=LEAF_NODE_CELLS_LEFT;
   *leaf_node_num_cells(new_node)=LEAF_NODE_CELLS_RIGHT;
+  touch_page(cur->table->pager, cur->page_num);
+  touch_page(cur->table->pager, page_num);
   if (is_node_root(old_node)){
     return creat_new_root(cur->table, page_num);
   } else {
@@ -483,7 +1317,9 @@ void insert_to_leaf(Cursor* cur, Row* value, uint32_t key){
   }
   *leaf_node_key(node, cur->cell_num) = key;
   serialize_row(value, leaf_node_value(node, cur->cell_num));
+  *leaf_node_flags(node, cur->cell_num) = 0;
   *leaf_node_num_cells(node) += 1;
+  touch_page(cur->table->pager, cur->page_num);
 }
 Cursor* leaf_node_find(Table* table, uint32_t page_num, uint32_t key){
   void* node = get_page(table->pager, page_num);
@@ -521,16 +1357,85 @@ Cursor* table_find(Table* table, uint32_t key, uint32_t page_num){
     return table_find(table, key, *internal_node_child(node, index));
   }
 }
-bool execute_insert(Table* table, Statement* statement){
-  Row* row_to_insert = &(statement->row_to_insert);
-  Cursor* cur = table_find(table, row_to_insert->id, table->root_page_num);
-  if (*leaf_node_key(get_page(table->pager, cur->page_num), cur->cell_num)==row_to_insert->id){
-    printf("id exists\n");
-    return false;
-  }
-  insert_to_leaf(cur, row_to_insert, row_to_insert->id);
-  free(cur);
-  return true;
+uint32_t lookup_hash(uint32_t key){
+  return (key*2654435761u)&(LOOKUP_CACHE_SIZE-1);
+}
+Cursor* lookup_cache_find(Table* table, uint32_t key){
+  if (table->cache==NULL){
+    return NULL;
+  }
+  uint32_t slot = lookup_hash(key);
+  LookupEntry* entry;
+  for (uint32_t i=0; i<LOOKUP_CACHE_PROBES; i++){
+    entry = &(table->cache->entries[(slot+i)&(LOOKUP_CACHE_SIZE-1)]);
+    if (!entry->used){
+      return NULL;
+    }
+    if (entry->key==key){
+      if (entry->version!=table->pager->page_version[entry->page_num]){
+        return NULL;
+      }
+      Cursor* cur = (Cursor*)malloc(sizeof(Cursor));
+      cur->table = table;
+      cur->page_num = entry->page_num;
+      cur->cell_num = entry->cell_num;
+      return cur;
+    }
+  }
+  return NULL;
+}
+void lookup_cache_put(Table* table, uint32_t key, uint32_t page_num, uint32_t cell_num){
+  if (table->cache==NULL){
+    return;
+  }
+  uint32_t slot = lookup_hash(key);
+  LookupEntry* entry = &(table->cache->entries[slot]);
+  for (uint32_t i=0; i<LOOKUP_CACHE_PROBES; i++){
+    LookupEntry* probe = &(table->cache->entries[(slot+i)&(LOOKUP_CACHE_SIZE-1)]);
+    if ((!probe->used)||(probe->key==key)){
+      entry = probe;
+      break;
+    }
+  }
+  entry->key = key;
+  entry->page_num = page_num;
+  entry->cell_num = cell_num;
+  entry->version = table->pager->page_version[page_num];
+  entry->used = true;
+}
+Cursor* table_lookup(Table* table, uint32_t key){
+  Cursor* cur = lookup_cache_find(table, key);
+  if (cur!=NULL){
+    return cur;
+  }
+  cur = table_find(table, key, table->root_page_num);
+  void* node = get_page(table->pager, cur->page_num);
+  if ((*leaf_node_num_cells(node)>cur->cell_num)&&(*leaf_node_key(node, cur->cell_num)==key)){
+    lookup_cache_put(table, key, cur->page_num, cur->cell_num);
+  }
+  return cur;
+}
+bool execute_insert(Table* table, Statement* statement){
+  Row* row_to_insert = &(statement->row_to_insert);
+  Cursor* cur = table_find(table, row_to_insert->id, table->root_page_num);
+  void* node = get_page(table->pager, cur->page_num);
+  if ((*leaf_node_num_cells(node)>cur->cell_num)&&(*leaf_node_key(node, cur->cell_num)==row_to_insert->id)){
+    if (!is_cell_deleted(node, cur->cell_num)){
+      printf("id exists\n");
+      free(cur);
+      return false;
+    }
+    serialize_row(row_to_insert, leaf_node_value(node, cur->cell_num));
+    *leaf_node_flags(node, cur->cell_num) = 0;
+    if (table->num_tombstones>0){
+      table->num_tombstones -= 1;
+    }
+    free(cur);
+    return true;
+  }
+  insert_to_leaf(cur, row_to_insert, row_to_insert->id);
+  free(cur);
+  return true;
 }
 
 void recursive_print(Table* table, uint32_t page_num){
@@ -539,6 +1444,9 @@ void recursive_print(Table* table, uint32_t page_num){
   if (node_type(node)==NODE_LEAF){
     Row row;
     for (uint32_t i=0; i<num_cells; i++){
+      if (is_cell_deleted(node, i)){
+        continue;
+      }
       deserialize_row(&row, leaf_node_value(node, i));
       print_row(row);
     }
@@ -555,6 +1463,178 @@ void execute_select(Table* table){
   recursive_print(table, table->root_page_num);
   printf("--------------------------------------------------\n");
 }
+bool match_predicate(Statement* stm, uint32_t key){
+  switch (stm->predicate) {
+    case PREDICATE_NONE:
+      return true;
+    case PREDICATE_LESS:
+      return key<stm->key;
+    case PREDICATE_GREATER:
+      return key>stm->key;
+    case PREDICATE_EQUAL:
+      return key==stm->key;
+  }
+  return false;
+}
+void initialize_aggregate(AggregateResult* res){
+  res->count = 0;
+  res->sum = 0;
+  res->min = UINT32_MAX;
+  res->max = 0;
+}
+void merge_aggregate(AggregateResult* des, AggregateResult* source){
+  des->count += source->count;
+  des->sum += source->sum;
+  if (source->min<des->min){
+    des->min = source->min;
+  }
+  if (source->max>des->max){
+    des->max = source->max;
+  }
+}
+void recursive_aggregate(Table* table, uint32_t page_num, Statement* stm, AggregateResult* res){
+  void* node = get_page(table->pager, page_num);
+  uint32_t num_cells = *leaf_node_num_cells(node);
+  if (node_type(node)==NODE_LEAF){
+    uint32_t key;
+    for (uint32_t i=0; i<num_cells; i++){
+      key = *leaf_node_key(node, i);
+      if ((is_cell_deleted(node, i))||(!match_predicate(stm, key))){
+        continue;
+      }
+      res->count += 1;
+      res->sum += key;
+      if (key<res->min){
+        res->min = key;
+      }
+      if (key>res->max){
+        res->max = key;
+      }
+    }
+  } else {
+    for (uint32_t i=0; i<=num_cells; i++){
+      recursive_aggregate(table, *internal_node_child(node, i), stm, res);
+    }
+  }
+}
+void* scan_worker(void* arg){
+  ScanWorker* worker = arg;
+  ScanJob* job = worker->job;
+  AggregateResult local;
+  initialize_aggregate(&local);
+  uint32_t morsel = __atomic_fetch_add(&(job->next_morsel), 1, __ATOMIC_RELAXED);
+  while (morsel<job->num_morsels){
+    recursive_aggregate(job->table, job->morsels[morsel], job->statement, &local);
+    morsel = __atomic_fetch_add(&(job->next_morsel), 1, __ATOMIC_RELAXED);
+  }
+  job->results[worker->worker_num] = local;
+  return NULL;
+}
+void split_into_morsels(Table* table, ScanJob* job, uint32_t num_workers){
+  job->morsels[0] = table->root_page_num;
+  job->num_morsels = 1;
+  bool expanded = true;
+  while ((job->num_morsels<num_workers)&&(expanded)){
+    uint32_t morsels[TABLE_MAX_PAGE];
+    uint32_t num_morsels = 0;
+    expanded = false;
+    for (uint32_t i=0; i<job->num_morsels; i++){
+      void* node = get_page(table->pager, job->morsels[i]);
+      if (node_type(node)==NODE_LEAF){
+        morsels[num_morsels++] = job->morsels[i];
+        continue;
+      }
+      for (uint32_t j=0; j<=*internal_node_num_key(node); j++){
+        morsels[num_morsels++] = *internal_node_child(node, j);
+      }
+      expanded = true;
+    }
+    memcpy(job->morsels, morsels, num_morsels*sizeof(uint32_t));
+    job->num_morsels = num_morsels;
+  }
+}
+void parallel_aggregate(Table* table, Statement* stm, AggregateResult* res){
+  ScanJob job;
+  job.table = table;
+  job.statement = stm;
+  job.next_morsel = 0;
+  long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  uint32_t num_workers = num_cpus<1?1:(num_cpus>SCAN_MAX_WORKERS?SCAN_MAX_WORKERS:num_cpus);
+  split_into_morsels(table, &job, num_workers);
+  if (num_workers>job.num_morsels){
+    num_workers = job.num_morsels;
+  }
+  pthread_t threads[SCAN_MAX_WORKERS];
+  ScanWorker workers[SCAN_MAX_WORKERS];
+  for (uint32_t i=0; i<num_workers; i++){
+    workers[i].job = &job;
+    workers[i].worker_num = i;
+    if (pthread_create(&threads[i], NULL, scan_worker, &workers[i])!=0){
+      printf("Error create thread\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  initialize_aggregate(res);
+  for (uint32_t i=0; i<num_workers; i++){
+    pthread_join(threads[i], NULL);
+    merge_aggregate(res, &(job.results[i]));
+  }
+}
+bool is_table_empty(Table* table){
+  void* root = get_page(table->pager, table->root_page_num);
+  return (node_type(root)==NODE_LEAF)&&(*leaf_node_num_cells(root)==0);
+}
+void table_aggregate(Table* table, Statement* stm, AggregateResult* res){
+  initialize_aggregate(res);
+  if (is_table_empty(table)){
+    return;
+  }
+  if ((stm->predicate==PREDICATE_NONE)&&((stm->aggregate==AGGREGATE_MIN)||(stm->aggregate==AGGREGATE_MAX))){
+    bool rightmost = stm->aggregate==AGGREGATE_MAX;
+    void* leaf = get_edge_leaf(table->pager, get_page(table->pager, table->root_page_num), rightmost);
+    uint32_t num_cells = *leaf_node_num_cells(leaf);
+    for (uint32_t i=0; i<num_cells; i++){
+      uint32_t cell_num = rightmost?num_cells-1-i:i;
+      if (!is_cell_deleted(leaf, cell_num)){
+        res->count = 1;
+        res->min = *leaf_node_key(leaf, cell_num);
+        res->max = res->min;
+        return;
+      }
+    }
+  }
+  parallel_aggregate(table, stm, res);
+}
+void print_aggregate(Statement* stm, AggregateResult* res){
+  switch (stm->aggregate) {
+    case AGGREGATE_COUNT:
+      printf("count(*) = %" PRIu64 "\n", res->count);
+      return;
+    case AGGREGATE_SUM:
+      printf("sum(id) = %" PRIu64 "\n", res->sum);
+      return;
+    case AGGREGATE_MIN:
+      if (res->count==0){
+        printf("min(id) = null\n");
+      } else {
+        printf("min(id) = %u\n", res->min);
+      }
+      return;
+    case AGGREGATE_MAX:
+      if (res->count==0){
+        printf("max(id) = null\n");
+      } else {
+        printf("max(id) = %u\n", res->max);
+      }
+      return;
+  }
+}
+bool execute_aggregate(Table* table, Statement* stm){
+  AggregateResult res;
+  table_aggregate(table, stm, &res);
+  print_aggregate(stm, &res);
+  return true;
+}
 void update_internal_node(Pager* pager, uint32_t page_num, uint32_t new_key) {
   void* node = get_page(pager, page_num);
   uint32_t index = internal_find(pager, new_key, page_num);
@@ -573,6 +1653,7 @@ void delete_leaf_cell(Pager* pager, uint32_t page_num, uint32_t cell_num) {
     memcpy(leaf_node_cell(node, i), leaf_node_cell(node, i+1), LEAF_NODE_CELL_SIZE);
   }
   *leaf_node_num_cells(node)-=1;
+  touch_page(pager, page_num);
   if ((num_cells-1==cell_num)&&(!is_node_root(node))){
     update_internal_node(pager, *get_parent(node), *leaf_node_key(node, cell_num-1));
   }
@@ -675,6 +1756,8 @@ void merge_leaf_node(Pager* pager, uint32_t page_num_left, uint32_t page_num_rig
   memcpy(leaf_node_cell(node_right, num_cells_left), leaf_node_cell(node_right, 0), (*leaf_node_num_cells(node_right))*LEAF_NODE_CELL_SIZE);
   memcpy(leaf_node_cell(node_right, 0), leaf_node_cell(node_left, 0), num_cells_left*LEAF_NODE_CELL_SIZE);
   *leaf_node_num_cells(node_right) += num_cells_left;
+  touch_page(pager, page_num_left);
+  touch_page(pager, page_num_right);
   uint32_t index_in_parent = internal_find(pager, *leaf_node_key(node_left, num_cells_left-1), *get_parent(node_left));
   memcpy(internal_node_cell(node_parent, index_in_parent), internal_node_cell(node_parent, index_in_parent+1), (*internal_node_num_key(node_parent)-index_in_parent-1)*INTERNAL_NODE_CELL_SIZE);
   *internal_node_num_key(node_parent)-=1;
@@ -684,10 +1767,11 @@ void merge_leaf_node(Pager* pager, uint32_t page_num_left, uint32_t page_num_rig
     uint32_t num_cells = *leaf_node_num_cells(node_right);
     memcpy(leaf_node_cell(node_parent, 0), leaf_node_cell(node_right, 0), num_cells*LEAF_NODE_CELL_SIZE);
     *leaf_node_num_cells(node_parent) = num_cells;
+    touch_page(pager, *get_parent(node_left));
   }
 }
-bool execute_delete(Table* table, uint32_t key){
-  Cursor* cur = table_find(table, key, table->root_page_num);
+bool delete_row(Table* table, uint32_t key){
+  Cursor* cur = table_lookup(table, key);
   void* node = get_page(table->pager, cur->page_num);
   if ((*leaf_node_key(node, cur->cell_num)!=key)||(*leaf_node_num_cells(node) <= cur->cell_num)){
     printf("id not found\n");
@@ -703,6 +1787,7 @@ bool execute_delete(Table* table, uint32_t key){
       if (right_num_cells>LEAF_NODE_CELLS_LEFT){
         memcpy(leaf_node_cell(node, *leaf_node_num_cells(node)), leaf_node_cell(right_node, 0), LEAF_NODE_CELL_SIZE);
         *leaf_node_num_cells(node)+=1;
+        touch_page(table->pager, *internal_node_child(parent, index_in_parent+1));
         *internal_node_key(parent, index_in_parent)=*leaf_node_key(node, *leaf_node_num_cells(node)-1);
         memcpy(leaf_node_cell(right_node, 0), leaf_node_cell(right_node, 1), (right_num_cells-1)*LEAF_NODE_CELL_SIZE);
         *leaf_node_num_cells(right_node)-=1;
@@ -719,6 +1804,7 @@ bool execute_delete(Table* table, uint32_t key){
         memcpy(leaf_node_cell(node, 0), leaf_node_cell(left_node, left_num_cells-1), LEAF_NODE_CELL_SIZE);
         *leaf_node_num_cells(node)+=1;
         *leaf_node_num_cells(left_node)-=1;
+        touch_page(table->pager, *internal_node_child(parent, index_in_parent-1));
         *internal_node_key(parent, index_in_parent-1)=*leaf_node_key(left_node, left_num_cells-2);
         delete_leaf_cell(table->pager, cur->page_num, cur->cell_num + 1);
         free(cur);
@@ -731,23 +1817,206 @@ bool execute_delete(Table* table, uint32_t key){
       merge_leaf_node(table->pager, *internal_node_child(parent, index_in_parent-1), *internal_node_child(parent, index_in_parent));
     }
     free(cur);
-    Cursor* cur = table_find(table, key, table->root_page_num);
+    cur = table_find(table, key, table->root_page_num);
   }
   delete_leaf_cell(table->pager, cur->page_num, cur->cell_num);
   free(cur);
   return true;
 }
+void collect_tombstones(Table* table, uint32_t page_num, uint32_t** keys, uint32_t* num_keys, uint32_t* capacity){
+  void* node = get_page(table->pager, page_num);
+  uint32_t num_cells = *leaf_node_num_cells(node);
+  if (node_type(node)==NODE_LEAF){
+    for (uint32_t i=0; i<num_cells; i++){
+      if (!is_cell_deleted(node, i)){
+        continue;
+      }
+      if (*num_keys==*capacity){
+        *capacity = *capacity==0?LAZY_DELETE_BATCH:*capacity*2;
+        *keys = realloc(*keys, *capacity*sizeof(uint32_t));
+      }
+      (*keys)[(*num_keys)++] = *leaf_node_key(node, i);
+    }
+  } else {
+    for (uint32_t i=0; i<=num_cells; i++){
+      collect_tombstones(table, *internal_node_child(node, i), keys, num_keys, capacity);
+    }
+  }
+}
+void collect_leaves(Table* table, uint32_t page_num, uint32_t* leaves, uint32_t* num_leaves){
+  void* node = get_page(table->pager, page_num);
+  if (node_type(node)==NODE_LEAF){
+    leaves[(*num_leaves)++] = page_num;
+    return;
+  }
+  uint32_t num_keys = *internal_node_num_key(node);
+  for (uint32_t i=0; i<=num_keys; i++){
+    collect_leaves(table, *internal_node_child(node, i), leaves, num_leaves);
+  }
+}
+uint32_t compact_leaf(Table* table, uint32_t page_num){
+  void* node = get_page(table->pager, page_num);
+  uint32_t num_cells = *leaf_node_num_cells(node);
+  bool max_deleted = (num_cells>0)&&(is_cell_deleted(node, num_cells-1));
+  uint32_t num_live = 0;
+  for (uint32_t i=0; i<num_cells; i++){
+    if (is_cell_deleted(node, i)){
+      continue;
+    }
+    if (num_live!=i){
+      memcpy(leaf_node_cell(node, num_live), leaf_node_cell(node, i), LEAF_NODE_CELL_SIZE);
+    }
+    num_live += 1;
+  }
+  if (num_live==num_cells){
+    return 0;
+  }
+  touch_page(table->pager, page_num);
+  if ((num_live==0)&&(!is_node_root(node))){
+    memcpy(leaf_node_cell(node, 0), leaf_node_cell(node, num_cells-1), LEAF_NODE_CELL_SIZE);
+    *leaf_node_num_cells(node) = 1;
+    return num_cells-1;
+  }
+  *leaf_node_num_cells(node) = num_live;
+  if ((max_deleted)&&(num_live>0)&&(!is_node_root(node))){
+    update_internal_node(table->pager, *get_parent(node), *leaf_node_key(node, num_live-1));
+  }
+  return num_cells-num_live;
+}
+void rebalance_leaf(Table* table, uint32_t page_num){
+  Pager* pager = table->pager;
+  void* node = get_page(pager, page_num);
+  uint32_t parent_page_num = *get_parent(node);
+  void* parent = get_page(pager, parent_page_num);
+  uint32_t index = internal_find(pager, *leaf_node_key(node, *leaf_node_num_cells(node)-1), parent_page_num);
+  if (index==*internal_node_num_key(parent)){
+    index -= 1;
+  }
+  uint32_t left_page_num = *internal_node_child(parent, index);
+  uint32_t right_page_num = *internal_node_child(parent, index+1);
+  void* left = get_page(pager, left_page_num);
+  void* right = get_page(pager, right_page_num);
+  uint32_t num_left = *leaf_node_num_cells(left);
+  uint32_t num_right = *leaf_node_num_cells(right);
+  uint32_t total = num_left+num_right;
+  if (total<=LEAF_NODE_MAX_CELLS){
+    merge_leaf_node(pager, left_page_num, right_page_num);
+    return;
+  }
+  uint32_t target = total/2;
+  if (num_left>target){
+    memmove(leaf_node_cell(right, num_left-target), leaf_node_cell(right, 0), num_right*LEAF_NODE_CELL_SIZE);
+    memcpy(leaf_node_cell(right, 0), leaf_node_cell(left, target), (num_left-target)*LEAF_NODE_CELL_SIZE);
+  } else {
+    memcpy(leaf_node_cell(left, num_left), leaf_node_cell(right, 0), (target-num_left)*LEAF_NODE_CELL_SIZE);
+    memmove(leaf_node_cell(right, 0), leaf_node_cell(right, target-num_left), (total-target)*LEAF_NODE_CELL_SIZE);
+  }
+  *leaf_node_num_cells(left) = target;
+  *leaf_node_num_cells(right) = total-target;
+  *internal_node_key(parent, index) = *leaf_node_key(left, target-1);
+  touch_page(pager, left_page_num);
+  touch_page(pager, right_page_num);
+}
+uint32_t count_tombstones(Table* table){
+  uint32_t* keys = NULL;
+  uint32_t num_keys = 0;
+  uint32_t capacity = 0;
+  collect_tombstones(table, table->root_page_num, &keys, &num_keys, &capacity);
+  free(keys);
+  return num_keys;
+}
+uint32_t compact_table(Table* table){
+  uint32_t leaves[TABLE_MAX_PAGE];
+  uint32_t num_leaves = 0;
+  uint32_t num_removed = 0;
+  collect_leaves(table, table->root_page_num, leaves, &num_leaves);
+  for (uint32_t i=0; i<num_leaves; i++){
+    num_removed += compact_leaf(table, leaves[i]);
+  }
+  while (true){
+    num_leaves = 0;
+    collect_leaves(table, table->root_page_num, leaves, &num_leaves);
+    uint32_t i = 0;
+    while ((i<num_leaves)&&((num_leaves==1)||(*leaf_node_num_cells(get_page(table->pager, leaves[i]))>=LEAF_NODE_CELLS_LEFT))){
+      i++;
+    }
+    if (i==num_leaves){
+      break;
+    }
+    rebalance_leaf(table, leaves[i]);
+  }
+  uint32_t* keys = NULL;
+  uint32_t num_keys = 0;
+  uint32_t capacity = 0;
+  collect_tombstones(table, table->root_page_num, &keys, &num_keys, &capacity);
+  for (uint32_t i=0; i<num_keys; i++){
+    delete_row(table, keys[i]);
+  }
+  free(keys);
+  table->num_tombstones = 0;
+  return num_removed+num_keys;
+}
+bool execute_delete(Table* table, uint32_t key){
+  Cursor* cur = table_lookup(table, key);
+  void* node = get_page(table->pager, cur->page_num);
+  if (!is_live_cell(node, cur->cell_num, key)){
+    printf("id not found\n");
+    free(cur);
+    return false;
+  }
+  if (!table->lazy_delete){
+    free(cur);
+    return delete_row(table, key);
+  }
+  *leaf_node_flags(node, cur->cell_num) |= CELL_FLAG_DELETED;
+  free(cur);
+  table->num_tombstones += 1;
+  if (table->num_tombstones>=LAZY_DELETE_BATCH){
+    compact_table(table);
+  }
+  return true;
+}
+bool execute_transaction(Table* table, Statement* stm){
+  Pager* pager = table->pager;
+  if ((stm->type==STATEMENT_BEGIN)&&(pager->in_transaction)){
+    printf("transaction already open\n");
+    return false;
+  }
+  if ((stm->type!=STATEMENT_BEGIN)&&(!pager->in_transaction)){
+    printf("no transaction open\n");
+    return false;
+  }
+  switch (stm->type) {
+    case STATEMENT_BEGIN:
+      pager_begin(pager);
+      table->undo_num_tombstones = table->num_tombstones;
+      return true;
+    case STATEMENT_COMMIT:
+      pager_commit(pager);
+      return true;
+    case STATEMENT_ROLLBACK:
+      pager_rollback(pager);
+      table->num_tombstones = table->undo_num_tombstones;
+      return true;
+    default:
+      return false;
+  }
+}
 bool execute_statement(Statement* stm, Table* table){
   switch (stm->type) {
+    case STATEMENT_BEGIN:
+    case STATEMENT_COMMIT:
+    case STATEMENT_ROLLBACK:
+      return execute_transaction(table, stm);
     case STATEMENT_INSERT:
       return execute_insert(table, stm);
     case STATEMENT_SELECT:
       execute_select(table);
       return true;
     case STATEMENT_SELECT_BY_ID:
-      Cursor* cur = table_find(table, stm->key, table->root_page_num);
+      Cursor* cur = table_lookup(table, stm->key);
       void* node = get_page(table->pager, cur->page_num);
-      if ((*leaf_node_key(node, cur->cell_num)==stm->key)&&(*leaf_node_num_cells(node)>cur->cell_num)){
+      if (is_live_cell(node, cur->cell_num, stm->key)){
         Row row;
         deserialize_row(&row, leaf_node_value(node, cur->cell_num));
         printf("__________________________________________________\n");
@@ -761,10 +2030,12 @@ bool execute_statement(Statement* stm, Table* table){
       return true;
     case STATEMENT_DELETE_BY_ID:
       return execute_delete(table, stm->key);
+    case STATEMENT_AGGREGATE:
+      return execute_aggregate(table, stm);
     case STATEMENT_UPDATE_BY_ID:
-      Cursor* cur_to_update = table_find(table, stm->row_to_insert.id, table->root_page_num);
+      Cursor* cur_to_update = table_lookup(table, stm->row_to_insert.id);
       void* node_to_update = get_page(table->pager, cur_to_update->page_num);
-      if ((*leaf_node_key(node_to_update, cur_to_update->cell_num)!=stm->row_to_insert.id)||(*leaf_node_num_cells(node_to_update)<=cur_to_update->cell_num)){
+      if (!is_live_cell(node_to_update, cur_to_update->cell_num, stm->row_to_insert.id)){
         printf("not found row when id = %d\n", stm->row_to_insert.id);
         free(cur_to_update);
         return false;
@@ -780,23 +2051,839 @@ bool execute_statement(Statement* stm, Table* table){
   }
 }
 
+void check_error(CheckResult* res, uint32_t page_num, const char* message){
+  printf("page %d: %s\n", page_num, message);
+  res->num_errors += 1;
+}
+void check_record_fill(CheckResult* res, uint32_t level, uint32_t num_cells, uint32_t max_cells){
+  uint32_t percent = num_cells*100/max_cells;
+  uint32_t bucket = percent>=100?CHECK_FILL_BUCKETS-1:percent*CHECK_FILL_BUCKETS/100;
+  res->num_nodes[level] += 1;
+  res->fill[level][bucket] += 1;
+  res->fill_sum[level] += percent;
+}
+bool check_key_in_range(CheckMorsel* m, uint32_t key){
+  return ((!m->has_low)||(key>m->low))&&((!m->has_high)||(key<=m->high));
+}
+void check_node(Pager* pager, CheckMorsel* m, uint32_t level, CheckResult* res){
+  if ((m->page_num>=pager->num_pages)||(m->page_num>=TABLE_MAX_PAGE)){
+    check_error(res, m->page_num, "child page out of range");
+    return;
+  }
+  if (level>=CHECK_MAX_LEVELS){
+    check_error(res, m->page_num, "tree too deep, possible cycle");
+    return;
+  }
+  void* node = get_page_checked(pager, m->page_num);
+  if (node==NULL){
+    check_error(res, m->page_num, "checksum mismatch");
+    return;
+  }
+  if ((level>0)&&(is_node_root(node))){
+    check_error(res, m->page_num, "non-root node marked as root");
+  }
+  if ((level>0)&&(*get_parent(node)!=m->parent_page_num)){
+    check_error(res, m->page_num, "parent pointer does not match parent");
+  }
+  if (node_type(node)==NODE_LEAF){
+    uint32_t num_cells = *leaf_node_num_cells(node);
+    if (num_cells>LEAF_NODE_MAX_CELLS){
+      check_error(res, m->page_num, "too many cells in leaf");
+      return;
+    }
+    for (uint32_t i=0; i<num_cells; i++){
+      uint32_t key = *leaf_node_key(node, i);
+      if ((i>0)&&(key<=*leaf_node_key(node, i-1))){
+        check_error(res, m->page_num, "leaf keys out of order");
+      }
+      if (!check_key_in_range(m, key)){
+        check_error(res, m->page_num, "leaf key outside parent separator range");
+      }
+    }
+    if (res->leaf_level==UINT32_MAX){
+      res->leaf_level = level;
+    } else if (res->leaf_level!=level){
+      check_error(res, m->page_num, "leaves at different depths");
+    }
+    check_record_fill(res, level, num_cells, LEAF_NODE_MAX_CELLS);
+    return;
+  }
+  if (node_type(node)!=NODE_INTERNAL){
+    check_error(res, m->page_num, "unknown node type");
+    return;
+  }
+  uint32_t num_keys = *internal_node_num_key(node);
+  if (num_keys>INTERNAL_NODE_MAX_CELLS){
+    check_error(res, m->page_num, "too many keys in internal node");
+    return;
+  }
+  check_record_fill(res, level, num_keys, INTERNAL_NODE_MAX_CELLS);
+  CheckMorsel child;
+  child.parent_page_num = m->page_num;
+  child.low = m->low;
+  child.has_low = m->has_low;
+  for (uint32_t i=0; i<=num_keys; i++){
+    child.page_num = *internal_node_child(node, i);
+    if (i<num_keys){
+      uint32_t key = *internal_node_key(node, i);
+      if ((i>0)&&(key<=*internal_node_key(node, i-1))){
+        check_error(res, m->page_num, "separator keys out of order");
+      }
+      if (!check_key_in_range(m, key)){
+        check_error(res, m->page_num, "separator key outside parent separator range");
+      }
+      child.high = key;
+      child.has_high = true;
+    } else {
+      child.high = m->high;
+      child.has_high = m->has_high;
+    }
+    check_node(pager, &child, level+1, res);
+    child.low = child.high;
+    child.has_low = child.has_high;
+  }
+}
+void initialize_check_result(CheckResult* res){
+  memset(res, 0, sizeof(CheckResult));
+  res->leaf_level = UINT32_MAX;
+}
+void merge_check_result(CheckResult* des, CheckResult* source){
+  des->num_errors += source->num_errors;
+  if (des->leaf_level==UINT32_MAX){
+    des->leaf_level = source->leaf_level;
+  } else if ((source->leaf_level!=UINT32_MAX)&&(source->leaf_level!=des->leaf_level)){
+    printf("leaves at different depths in different subtrees\n");
+    des->num_errors += 1;
+  }
+  for (uint32_t i=0; i<CHECK_MAX_LEVELS; i++){
+    des->num_nodes[i] += source->num_nodes[i];
+    des->fill_sum[i] += source->fill_sum[i];
+    for (uint32_t j=0; j<CHECK_FILL_BUCKETS; j++){
+      des->fill[i][j] += source->fill[i][j];
+    }
+  }
+}
+void* check_worker(void* arg){
+  CheckWorker* worker = arg;
+  CheckJob* job = worker->job;
+  CheckResult* res = &(job->results[worker->worker_num]);
+  initialize_check_result(res);
+  uint32_t morsel = __atomic_fetch_add(&(job->next_morsel), 1, __ATOMIC_RELAXED);
+  while (morsel<job->num_morsels){
+    check_node(job->table->pager, &(job->morsels[morsel]), 1, res);
+    morsel = __atomic_fetch_add(&(job->next_morsel), 1, __ATOMIC_RELAXED);
+  }
+  return NULL;
+}
+void print_check_result(CheckResult* res){
+  printf("integrity check: %d errors\n", res->num_errors);
+  for (uint32_t i=0; (i<CHECK_MAX_LEVELS)&&(res->num_nodes[i]>0); i++){
+    printf("level %d: %d nodes, avg fill %" PRIu64 "%% |", i, res->num_nodes[i], res->fill_sum[i]/res->num_nodes[i]);
+    for (uint32_t j=0; j<CHECK_FILL_BUCKETS; j++){
+      printf(" %d-%d%%: %d |", j*100/CHECK_FILL_BUCKETS, (j+1)*100/CHECK_FILL_BUCKETS, res->fill[i][j]);
+    }
+    printf("\n");
+  }
+}
+void execute_check(Table* table){
+  CheckJob job;
+  job.table = table;
+  job.num_morsels = 0;
+  job.next_morsel = 0;
+  CheckResult res;
+  initialize_check_result(&res);
+  void* root = get_page_checked(table->pager, table->root_page_num);
+  if (root==NULL){
+    check_error(&res, table->root_page_num, "checksum mismatch");
+    print_check_result(&res);
+    return;
+  }
+  if (!is_node_root(root)){
+    check_error(&res, table->root_page_num, "root node not marked as root");
+  }
+  if (node_type(root)==NODE_LEAF){
+    CheckMorsel m = {table->root_page_num, 0, 0, 0, false, false};
+    check_node(table->pager, &m, 0, &res);
+    print_check_result(&res);
+    return;
+  }
+  uint32_t num_keys = *internal_node_num_key(root);
+  if (num_keys>INTERNAL_NODE_MAX_CELLS){
+    check_error(&res, table->root_page_num, "too many keys in internal node");
+    print_check_result(&res);
+    return;
+  }
+  check_record_fill(&res, 0, num_keys, INTERNAL_NODE_MAX_CELLS);
+  for (uint32_t i=0; i<=num_keys; i++){
+    CheckMorsel* m = &(job.morsels[job.num_morsels++]);
+    m->page_num = *internal_node_child(root, i);
+    m->parent_page_num = table->root_page_num;
+    m->has_low = i>0;
+    m->low = i>0?*internal_node_key(root, i-1):0;
+    m->has_high = i<num_keys;
+    m->high = i<num_keys?*internal_node_key(root, i):0;
+    if ((i>0)&&(i<num_keys)&&(m->high<=m->low)){
+      check_error(&res, table->root_page_num, "separator keys out of order");
+    }
+  }
+  long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  uint32_t num_workers = num_cpus<1?1:(num_cpus>SCAN_MAX_WORKERS?SCAN_MAX_WORKERS:num_cpus);
+  if (num_workers>job.num_morsels){
+    num_workers = job.num_morsels;
+  }
+  pthread_t threads[SCAN_MAX_WORKERS];
+  CheckWorker workers[SCAN_MAX_WORKERS];
+  for (uint32_t i=0; i<num_workers; i++){
+    workers[i].job = &job;
+    workers[i].worker_num = i;
+    if (pthread_create(&threads[i], NULL, check_worker, &workers[i])!=0){
+      printf("Error create thread\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  for (uint32_t i=0; i<num_workers; i++){
+    pthread_join(threads[i], NULL);
+    merge_check_result(&res, &(job.results[i]));
+  }
+  print_check_result(&res);
+}
+void* backup_worker(void* arg){
+  Pager* pager = arg;
+  Backup* backup = pager->backup;
+  void* image = malloc(PAGES_SIZE);
+  uint8_t header[FILE_HEADER_SIZE];
+  encode_file_header(header, FILE_MAGIC, backup->num_pages);
+  if (pwrite(backup->file_des, header, FILE_HEADER_SIZE, 0)==-1){
+    printf("Error write backup\n");
+    exit(EXIT_FAILURE);
+  }
+  for (uint32_t i=0; i<backup->num_pages; i++){
+    bool unchanged_on_disk = false;
+    pthread_mutex_lock(&(pager->lock));
+    if (backup->before_images[i]!=NULL){
+      memcpy(image, backup->before_images[i], PAGES_SIZE);
+      free(backup->before_images[i]);
+      backup->before_images[i] = NULL;
+    } else if (pager->pages[i]!=NULL){
+      memcpy(image, pager->pages[i], PAGES_SIZE);
+    } else if ((backup->incremental)&&(pager->backup_checksum_valid[i])){
+      unchanged_on_disk = true;
+    } else {
+      pager_read_page(pager, i, image);
+    }
+    backup->copied[i] = true;
+    pthread_mutex_unlock(&(pager->lock));
+    if (unchanged_on_disk){
+      continue;
+    }
+    uint32_t checksum = page_checksum(image);
+    if ((backup->incremental)&&(pager->backup_checksum_valid[i])&&(pager->backup_checksums[i]==checksum)){
+      continue;
+    }
+    *get_checksum(image) = checksum;
+    if (pwrite(backup->file_des, image, PAGES_SIZE, FILE_HEADER_SIZE+PAGES_SIZE*i)==-1){
+      printf("Error write backup\n");
+      exit(EXIT_FAILURE);
+    }
+    pager->backup_checksums[i] = checksum;
+    pager->backup_checksum_valid[i] = true;
+    backup->num_written += 1;
+  }
+  free(image);
+  if ((ftruncate(backup->file_des, FILE_HEADER_SIZE+PAGES_SIZE*backup->num_pages)==-1)||(fsync(backup->file_des)==-1)){
+    printf("Error write backup\n");
+    exit(EXIT_FAILURE);
+  }
+  close(backup->file_des);
+  printf("backup to %s finished: %d of %d pages written\n", backup->path, backup->num_written, backup->num_pages);
+  fflush(stdout);
+  pthread_mutex_lock(&(pager->lock));
+  backup->running = false;
+  pthread_mutex_unlock(&(pager->lock));
+  return NULL;
+}
+void finish_backup(Pager* pager){
+  if (pager->backup==NULL){
+    return;
+  }
+  pthread_join(pager->backup_thread, NULL);
+  free(pager->last_backup_path);
+  pager->last_backup_path = pager->backup->path;
+  free(pager->backup);
+  pager->backup = NULL;
+}
+bool start_backup(Pager* pager, const char* path, bool incremental){
+  finish_backup(pager);
+  if ((incremental)&&((pager->last_backup_path==NULL)||(strcmp(pager->last_backup_path, path)!=0))){
+    printf("no previous backup to %s, taking a full backup\n", path);
+    incremental = false;
+  }
+  int fd = open(path, incremental?O_RDWR:O_RDWR|O_CREAT|O_TRUNC, S_IWUSR|S_IRUSR);
+  if ((fd==-1)&&(incremental)){
+    printf("cannot open %s, taking a full backup\n", path);
+    incremental = false;
+    fd = open(path, O_RDWR|O_CREAT|O_TRUNC, S_IWUSR|S_IRUSR);
+  }
+  if (fd==-1){
+    printf("Error open file\n");
+    return false;
+  }
+  Backup* backup = (Backup*)calloc(1, sizeof(Backup));
+  backup->path = strdup(path);
+  backup->file_des = fd;
+  backup->incremental = incremental;
+  backup->running = true;
+  if (!incremental){
+    for (uint32_t i=0; i<TABLE_MAX_PAGE; i++){
+      pager->backup_checksum_valid[i] = false;
+    }
+  }
+  pthread_mutex_lock(&(pager->lock));
+  backup->num_pages = pager->num_pages;
+  if (pager->in_transaction){
+    backup->num_pages = pager->undo_num_pages;
+    for (uint32_t i=0; i<backup->num_pages; i++){
+      if (pager->undo_images[i]!=NULL){
+        backup->before_images[i] = malloc(PAGES_SIZE);
+        memcpy(backup->before_images[i], pager->undo_images[i], PAGES_SIZE);
+      }
+    }
+  }
+  pager->backup = backup;
+  pthread_mutex_unlock(&(pager->lock));
+  if (pthread_create(&(pager->backup_thread), NULL, backup_worker, pager)!=0){
+    printf("Error create thread\n");
+    exit(EXIT_FAILURE);
+  }
+  return true;
+}
+bool parse_backup_command(char* buffer, bool* incremental, char** path){
+  if (strncmp(buffer, ".backup incremental ", 20)==0){
+    *incremental = true;
+    *path = buffer+20;
+    return true;
+  }
+  if (strncmp(buffer, ".backup ", 8)==0){
+    *incremental = false;
+    *path = buffer+8;
+    return true;
+  }
+  return false;
+}
+bool execute_meta_command(InputBuffer* inp_buf, Table* table){
+  bool incremental;
+  char* path;
+  if (parse_backup_command(inp_buf->buffer, &incremental, &path)){
+    start_backup(table->pager, path, incremental);
+    return true;
+  }
+  if (strcmp(inp_buf->buffer, ".cache on")==0){
+    if (table->cache==NULL){
+      table->cache = (LookupCache*)calloc(1, sizeof(LookupCache));
+    }
+    return true;
+  }
+  if (strcmp(inp_buf->buffer, ".cache off")==0){
+    free(table->cache);
+    table->cache = NULL;
+    return true;
+  }
+  if (strcmp(inp_buf->buffer, ".lazy on")==0){
+    table->lazy_delete = true;
+    table->num_tombstones = count_tombstones(table);
+    return true;
+  }
+  if (strcmp(inp_buf->buffer, ".lazy off")==0){
+    table->lazy_delete = false;
+    return true;
+  }
+  if (strcmp(inp_buf->buffer, ".check")==0){
+    execute_check(table);
+    return true;
+  }
+  if (strcmp(inp_buf->buffer, ".compact")==0){
+    printf("compacted %d rows\n", compact_table(table));
+    return true;
+  }
+  return false;
+}
+void row_buffer_push(RowBuffer* buf, Row* row){
+  if (buf->num_rows==buf->capacity){
+    buf->capacity = buf->capacity==0?ROW_BUFFER_INITIAL_ROWS:buf->capacity*2;
+    buf->rows = realloc(buf->rows, buf->capacity*sizeof(Row));
+  }
+  buf->rows[buf->num_rows++] = *row;
+}
+void recursive_collect(Table* table, uint32_t page_num, RowBuffer* buf){
+  void* node = get_page(table->pager, page_num);
+  uint32_t num_cells = *leaf_node_num_cells(node);
+  if (node_type(node)==NODE_LEAF){
+    Row row;
+    for (uint32_t i=0; i<num_cells; i++){
+      if (is_cell_deleted(node, i)){
+        continue;
+      }
+      deserialize_row(&row, leaf_node_value(node, i));
+      row_buffer_push(buf, &row);
+    }
+  } else {
+    for (uint32_t i=0; i<=num_cells; i++){
+      recursive_collect(table, *internal_node_child(node, i), buf);
+    }
+  }
+}
+void* shard_worker(void* arg){
+  Shard* shard = arg;
+  pthread_mutex_lock(&(shard->lock));
+  while (1){
+    while (shard->task==NULL){
+      pthread_cond_wait(&(shard->cond), &(shard->lock));
+    }
+    ShardTask* task = shard->task;
+    pthread_mutex_unlock(&(shard->lock));
+    switch (task->type) {
+      case SHARD_TASK_STATEMENT:
+        task->result = execute_statement(task->statement, shard->table);
+        break;
+      case SHARD_TASK_COLLECT:
+        recursive_collect(shard->table, shard->table->root_page_num, &(task->rows));
+        break;
+      case SHARD_TASK_AGGREGATE:
+        table_aggregate(shard->table, task->statement, &(task->aggregate));
+        break;
+      case SHARD_TASK_META:
+        task->result = execute_meta_command(task->inp_buf, shard->table);
+        break;
+      case SHARD_TASK_EXIT:
+        break;
+    }
+    pthread_mutex_lock(&(shard->lock));
+    task->done = true;
+    shard->task = NULL;
+    pthread_cond_broadcast(&(shard->cond));
+    if (task->type==SHARD_TASK_EXIT){
+      pthread_mutex_unlock(&(shard->lock));
+      return NULL;
+    }
+  }
+}
+void shard_submit(Shard* shard, ShardTask* task){
+  pthread_mutex_lock(&(shard->lock));
+  task->done = false;
+  shard->task = task;
+  pthread_cond_broadcast(&(shard->cond));
+  pthread_mutex_unlock(&(shard->lock));
+}
+void shard_wait(Shard* shard, ShardTask* task){
+  pthread_mutex_lock(&(shard->lock));
+  while (!task->done){
+    pthread_cond_wait(&(shard->cond), &(shard->lock));
+  }
+  pthread_mutex_unlock(&(shard->lock));
+}
+void initialize_shard_task(ShardTask* task, ShardTaskType type){
+  memset(task, 0, sizeof(ShardTask));
+  task->type = type;
+}
+char* shard_filename(ShardSet* set, uint32_t file_num){
+  char* filename = malloc(strlen(set->filename)+16);
+  sprintf(filename, "%s.%d", set->filename, file_num);
+  return filename;
+}
+Shard* open_shard(ShardSet* set, uint32_t file_num, uint32_t low_key){
+  char* filename = shard_filename(set, file_num);
+  Shard* shard = (Shard*)malloc(sizeof(Shard));
+  shard->table = open_db(filename, set->compressed);
+  shard->low_key = low_key;
+  shard->file_num = file_num;
+  shard->task = NULL;
+  shard->has_pending = false;
+  shard->split_failed = false;
+  pthread_mutex_init(&(shard->lock), NULL);
+  pthread_cond_init(&(shard->cond), NULL);
+  free(filename);
+  return shard;
+}
+Shard* create_shard(ShardSet* set, uint32_t file_num, uint32_t low_key){
+  char* filename = shard_filename(set, file_num);
+  unlink(filename);
+  free(filename);
+  return open_shard(set, file_num, low_key);
+}
+void start_shard(Shard* shard){
+  if (pthread_create(&(shard->thread), NULL, shard_worker, shard)!=0){
+    printf("Error create thread\n");
+    exit(EXIT_FAILURE);
+  }
+}
+void stop_shard(Shard* shard){
+  ShardTask task;
+  initialize_shard_task(&task, SHARD_TASK_EXIT);
+  shard_submit(shard, &task);
+  pthread_join(shard->thread, NULL);
+  pthread_mutex_destroy(&(shard->lock));
+  pthread_cond_destroy(&(shard->cond));
+}
+void write_shard_manifest(ShardSet* set, const char* base_filename){
+  char* filename = malloc(strlen(base_filename)+8);
+  char* temp_filename = malloc(strlen(base_filename)+12);
+  sprintf(filename, "%s.shards", base_filename);
+  sprintf(temp_filename, "%s.shards.tmp", base_filename);
+  FILE* manifest = fopen(temp_filename, "w");
+  if (manifest==NULL){
+    printf("Error open file\n");
+    exit(EXIT_FAILURE);
+  }
+  fprintf(manifest, "%d %d\n", set->num_shards, set->next_file_num);
+  for (uint32_t i=0; i<set->num_shards; i++){
+    fprintf(manifest, "%d %u\n", set->shards[i]->file_num, set->shards[i]->low_key);
+  }
+  if ((fflush(manifest)!=0)||(fsync(fileno(manifest))==-1)||(fclose(manifest)!=0)||(rename(temp_filename, filename)==-1)){
+    printf("Error write\n");
+    exit(EXIT_FAILURE);
+  }
+  free(temp_filename);
+  free(filename);
+}
+ShardSet* open_shards(const char* filename, uint32_t num_shards, bool compressed){
+  ShardSet* set = (ShardSet*)malloc(sizeof(ShardSet));
+  set->filename = filename;
+  set->compressed = compressed;
+  set->in_transaction = false;
+  char* manifest_name = malloc(strlen(filename)+8);
+  sprintf(manifest_name, "%s.shards", filename);
+  FILE* manifest = fopen(manifest_name, "r");
+  free(manifest_name);
+  if (manifest!=NULL){
+    uint32_t file_num, low_key;
+    if ((fscanf(manifest, "%u %u", &(set->num_shards), &(set->next_file_num))<2)||(set->num_shards==0)||(set->num_shards>MAX_SHARDS)){
+      printf("Error read shard manifest\n");
+      exit(EXIT_FAILURE);
+    }
+    for (uint32_t i=0; i<set->num_shards; i++){
+      if (fscanf(manifest, "%u %u", &file_num, &low_key)<2){
+        printf("Error read shard manifest\n");
+        exit(EXIT_FAILURE);
+      }
+      set->shards[i] = open_shard(set, file_num, low_key);
+    }
+    fclose(manifest);
+  } else {
+    set->num_shards = num_shards;
+    set->next_file_num = num_shards;
+    for (uint32_t i=0; i<num_shards; i++){
+      set->shards[i] = create_shard(set, i, (uint32_t)(((uint64_t)INT32_MAX+1)*i/num_shards));
+    }
+    write_shard_manifest(set, set->filename);
+  }
+  for (uint32_t i=0; i<set->num_shards; i++){
+    start_shard(set->shards[i]);
+  }
+  return set;
+}
+void drain_shards(ShardSet* set);
+void close_shards(ShardSet* set){
+  drain_shards(set);
+  write_shard_manifest(set, set->filename);
+  for (uint32_t i=0; i<set->num_shards; i++){
+    stop_shard(set->shards[i]);
+    close_db(set->shards[i]->table);
+    free(set->shards[i]);
+  }
+  free(set);
+}
+uint32_t find_shard(ShardSet* set, uint32_t key){
+  uint32_t start = 0;
+  uint32_t end = set->num_shards;
+  uint32_t mid;
+  while (end-start>1) {
+    mid = (start+end)/2;
+    if (set->shards[mid]->low_key<=key){
+      start = mid;
+    } else {
+      end = mid;
+    }
+  }
+  return start;
+}
+bool split_shard(ShardSet* set, uint32_t index){
+  if (set->in_transaction){
+    printf("cannot split a shard inside a transaction\n");
+    return false;
+  }
+  if (set->num_shards>=MAX_SHARDS){
+    printf("too many shards\n");
+    set->shards[index]->split_failed = true;
+    return false;
+  }
+  Shard* old_shard = set->shards[index];
+  ShardTask task;
+  initialize_shard_task(&task, SHARD_TASK_COLLECT);
+  shard_submit(old_shard, &task);
+  shard_wait(old_shard, &task);
+  if (task.rows.num_rows<2){
+    printf("shard %d is too small to split\n", index);
+    old_shard->split_failed = true;
+    free(task.rows.rows);
+    return false;
+  }
+  uint32_t split_key = task.rows.rows[task.rows.num_rows/2].id;
+  Shard* left = create_shard(set, set->next_file_num++, old_shard->low_key);
+  Shard* right = create_shard(set, set->next_file_num++, split_key);
+  Statement stm;
+  stm.type = STATEMENT_INSERT;
+  for (uint32_t i=0; i<task.rows.num_rows; i++){
+    stm.row_to_insert = task.rows.rows[i];
+    execute_insert(i<task.rows.num_rows/2?left->table:right->table, &stm);
+  }
+  free(task.rows.rows);
+  Table* new_tables[2] = {left->table, right->table};
+  for (uint32_t i=0; i<2; i++){
+    new_tables[i]->lazy_delete = old_shard->table->lazy_delete;
+    if (old_shard->table->cache==NULL){
+      free(new_tables[i]->cache);
+      new_tables[i]->cache = NULL;
+    }
+    flush_db(new_tables[i]);
+  }
+  stop_shard(old_shard);
+  close_db(old_shard->table);
+  memmove(&(set->shards[index+2]), &(set->shards[index+1]), (set->num_shards-index-1)*sizeof(Shard*));
+  set->shards[index] = left;
+  set->shards[index+1] = right;
+  set->num_shards += 1;
+  write_shard_manifest(set, set->filename);
+  char* filename = shard_filename(set, old_shard->file_num);
+  unlink(filename);
+  free(filename);
+  free(old_shard);
+  start_shard(left);
+  start_shard(right);
+  return true;
+}
+void wait_pending(ShardSet* set, uint32_t index){
+  Shard* shard = set->shards[index];
+  if (!shard->has_pending){
+    return;
+  }
+  shard_wait(shard, &(shard->pending));
+  shard->has_pending = false;
+  if ((!set->in_transaction)&&(!shard->split_failed)&&(shard->table->pager->num_pages>=SHARD_SPLIT_PAGES)){
+    split_shard(set, index);
+  }
+}
+void drain_shards(ShardSet* set){
+  for (uint32_t i=0; i<set->num_shards; i++){
+    wait_pending(set, i);
+  }
+}
+bool execute_sharded_statement(Statement* stm, ShardSet* set){
+  ShardTask tasks[MAX_SHARDS];
+  uint32_t key;
+  uint32_t index;
+  Shard* shard;
+  if (stm->type!=STATEMENT_INSERT){
+    drain_shards(set);
+  }
+  switch (stm->type) {
+    case STATEMENT_BEGIN:
+    case STATEMENT_COMMIT:
+    case STATEMENT_ROLLBACK:
+      if ((stm->type==STATEMENT_BEGIN)&&(set->in_transaction)){
+        printf("transaction already open\n");
+        return false;
+      }
+      if ((stm->type!=STATEMENT_BEGIN)&&(!set->in_transaction)){
+        printf("no transaction open\n");
+        return false;
+      }
+      for (uint32_t i=0; i<set->num_shards; i++){
+        initialize_shard_task(&tasks[i], SHARD_TASK_STATEMENT);
+        tasks[i].statement = stm;
+        shard_submit(set->shards[i], &tasks[i]);
+      }
+      for (uint32_t i=0; i<set->num_shards; i++){
+        shard_wait(set->shards[i], &tasks[i]);
+      }
+      set->in_transaction = stm->type==STATEMENT_BEGIN;
+      for (uint32_t i=0; (stm->type==STATEMENT_COMMIT)&&(i<set->num_shards); i++){
+        if ((!set->shards[i]->split_failed)&&(set->shards[i]->table->pager->num_pages>=SHARD_SPLIT_PAGES)){
+          split_shard(set, i);
+        }
+      }
+      return true;
+    case STATEMENT_SELECT:
+      for (uint32_t i=0; i<set->num_shards; i++){
+        initialize_shard_task(&tasks[i], SHARD_TASK_COLLECT);
+        shard_submit(set->shards[i], &tasks[i]);
+      }
+      printf("__________________________________________________\n");
+      printf("| %-*s | %*s | %*s |\n", 5, "ID", 10, "USER_NAME", 25, "EMAIL");
+      printf("| %-*s | %-*s | %*s |\n", 5, "-----", 10, "----------", 25, "-------------------------");
+      for (uint32_t i=0; i<set->num_shards; i++){
+        shard_wait(set->shards[i], &tasks[i]);
+        for (uint32_t j=0; j<tasks[i].rows.num_rows; j++){
+          print_row(tasks[i].rows.rows[j]);
+        }
+        free(tasks[i].rows.rows);
+      }
+      printf("--------------------------------------------------\n");
+      return true;
+    case STATEMENT_AGGREGATE:
+      for (uint32_t i=0; i<set->num_shards; i++){
+        initialize_shard_task(&tasks[i], SHARD_TASK_AGGREGATE);
+        tasks[i].statement = stm;
+        shard_submit(set->shards[i], &tasks[i]);
+      }
+      AggregateResult res;
+      initialize_aggregate(&res);
+      for (uint32_t i=0; i<set->num_shards; i++){
+        shard_wait(set->shards[i], &tasks[i]);
+        merge_aggregate(&res, &(tasks[i].aggregate));
+      }
+      print_aggregate(stm, &res);
+      return true;
+    case STATEMENT_INSERT:
+      wait_pending(set, find_shard(set, stm->row_to_insert.id));
+      index = find_shard(set, stm->row_to_insert.id);
+      shard = set->shards[index];
+      if ((set->in_transaction)&&(shard->table->pager->num_pages>=SHARD_SPLIT_PAGES)){
+        printf("shard %d is full, commit the transaction before inserting into it\n", index);
+        return false;
+      }
+      if ((shard->split_failed)&&(shard->table->pager->num_pages>=SHARD_SPLIT_PAGES)){
+        printf("shard %d is full and cannot be split\n", index);
+        return false;
+      }
+      shard->pending_statement = *stm;
+      initialize_shard_task(&(shard->pending), SHARD_TASK_STATEMENT);
+      shard->pending.statement = &(shard->pending_statement);
+      shard->has_pending = true;
+      shard_submit(shard, &(shard->pending));
+      return true;
+    case STATEMENT_UPDATE_BY_ID:
+      key = stm->row_to_insert.id;
+      break;
+    case STATEMENT_SELECT_BY_ID:
+    case STATEMENT_DELETE_BY_ID:
+      key = stm->key;
+      break;
+    default:
+      return false;
+  }
+  index = find_shard(set, key);
+  shard = set->shards[index];
+  initialize_shard_task(&tasks[0], SHARD_TASK_STATEMENT);
+  tasks[0].statement = stm;
+  shard_submit(shard, &tasks[0]);
+  shard_wait(shard, &tasks[0]);
+  return tasks[0].result;
+}
+bool execute_shard_meta_command(InputBuffer* inp_buf, ShardSet* set){
+  uint32_t index;
+  drain_shards(set);
+  if (strcmp(inp_buf->buffer, ".shards")==0){
+    for (uint32_t i=0; i<set->num_shards; i++){
+      printf("shard %d: ids from %u, file %s.%d, %d pages\n", i, set->shards[i]->low_key,
+        set->filename, set->shards[i]->file_num, set->shards[i]->table->pager->num_pages);
+    }
+    return true;
+  }
+  if (sscanf(inp_buf->buffer, ".split %u", &index)==1){
+    if (index>=set->num_shards){
+      printf("shard %d does not exist\n", index);
+      return true;
+    }
+    split_shard(set, index);
+    return true;
+  }
+  bool result = true;
+  ShardTask task;
+  bool incremental;
+  char* path;
+  if (parse_backup_command(inp_buf->buffer, &incremental, &path)){
+    InputBuffer shard_inp_buf;
+    shard_inp_buf.buffer = malloc(strlen(inp_buf->buffer)+16);
+    for (uint32_t i=0; i<set->num_shards; i++){
+      sprintf(shard_inp_buf.buffer, ".backup %s%s.%d", incremental?"incremental ":"", path, set->shards[i]->file_num);
+      initialize_shard_task(&task, SHARD_TASK_META);
+      task.inp_buf = &shard_inp_buf;
+      shard_submit(set->shards[i], &task);
+      shard_wait(set->shards[i], &task);
+    }
+    free(shard_inp_buf.buffer);
+    write_shard_manifest(set, path);
+    return true;
+  }
+  for (uint32_t i=0; i<set->num_shards; i++){
+    if ((strcmp(inp_buf->buffer, ".check")==0)||(strcmp(inp_buf->buffer, ".compact")==0)){
+      printf("shard %d:\n", i);
+    }
+    initialize_shard_task(&task, SHARD_TASK_META);
+    task.inp_buf = inp_buf;
+    shard_submit(set->shards[i], &task);
+    shard_wait(set->shards[i], &task);
+    result = result&&task.result;
+  }
+  return result;
+}
+
 int main(int argc, char const *argv[]) {
   InputBuffer* inp_buf = new_inp_buf();
-  Table* table = open_db("data.db");
+  Table* table = NULL;
+  ShardSet* shards = NULL;
+  int num_shards = 0;
+  bool compressed = false;
+  for (int i=1; i<argc; i++){
+    if ((strcmp(argv[i], "-s")==0)&&(i+1<argc)){
+      num_shards = atoi(argv[++i]);
+      if ((num_shards<1)||(num_shards>MAX_SHARDS)){
+        printf("number of shards must be between 1 and %d\n", MAX_SHARDS);
+        exit(EXIT_FAILURE);
+      }
+    } else if (strcmp(argv[i], "-z")==0){
+      compressed = true;
+    } else {
+      printf("usage: %s [-s shards] [-z]\n", argv[0]);
+      exit(EXIT_FAILURE);
+    }
+  }
+  if (num_shards>0){
+    shards = open_shards("data.db", num_shards, compressed);
+  } else {
+    table = open_db("data.db", compressed);
+  }
   while (1){
     print_pr();
     read_input(inp_buf);
     if (strcmp(inp_buf->buffer, ".exit")==0){
       close_input_buffer(inp_buf);
-      close_db(table);
+      if (shards!=NULL){
+        close_shards(shards);
+      } else {
+        close_db(table);
+      }
       exit(EXIT_SUCCESS);
     }
+    if (inp_buf->buffer[0]=='.'){
+      bool recognized = shards!=NULL?execute_shard_meta_command(inp_buf, shards):execute_meta_command(inp_buf, table);
+      if (recognized){
+        printf("Executed.\n");
+      } else {
+        printf("unrecognized command\n");
+      }
+      continue;
+    }
     Statement statement;
     if (prepare_statement(inp_buf, &statement)==false){
       printf("query exis\n");
       continue;
     }
-    execute_statement(&statement, table);
+    if (shards!=NULL){
+      execute_sharded_statement(&statement, shards);
+    } else {
+      execute_statement(&statement, table);
+    }
     printf("Executed.\n");
   }
   return 0;